@@ -5,9 +5,20 @@
 #define SQLITEPP_SQLITEPP_H_
 
 #include <sqlite3.h>
+#include <atomic>
+#include <chrono>  // NOLINT(build/c++11)
+#include <condition_variable>  // NOLINT(build/c++11)
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <mutex>  // NOLINT(build/c++11)
 #include <stdexcept>
 #include <memory>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
 
 /// \file
 /// \brief Defines all classes of the sqlitepp library in the namespace
@@ -88,6 +99,107 @@
 /// }
 /// \endcode
 ///
+/// \subsection cache Caching query results
+/// If the same read-only queries are executed repeatedly, you can enable a
+/// result cache for a database using sqlitepp::Database::enableQueryCache.
+/// Results are cached by their SQL string including the bound values and
+/// invalidated when the tables they read from are changed:
+/// \code{.cpp}
+/// sqlitepp::Database database("/path/to/database.sqlite");
+/// database.enableQueryCache(16 * 1024 * 1024);
+/// \endcode
+///
+/// \subsection changes Observing changes
+/// To get notified about the rows changed by committed transactions, use
+/// sqlitepp::Database::subscribeChanges. You can either pass a callback that
+/// is called after each commit or a sqlitepp::ChangeQueue that is polled by
+/// another thread:
+/// \code{.cpp}
+/// sqlitepp::Database database("/path/to/database.sqlite");
+/// auto queue = std::make_shared<sqlitepp::ChangeQueue>(1024);
+/// database.subscribeChanges(queue);
+/// // on the consumer thread:
+/// std::shared_ptr<const sqlitepp::ChangeBatch> batch;
+/// while (queue->pop(&batch)) {
+///   for (const sqlitepp::Change& change : *batch) {
+///     std::cout << change.table << ": " << change.rowId << std::endl;
+///   }
+/// }
+/// \endcode
+///
+/// \subsection checkpoints Checkpointing in the background
+/// In WAL mode, SQLite3 runs checkpoints during commits per default. To move
+/// them to a background thread, attach the connections to a
+/// sqlitepp::CheckpointManager:
+/// \code{.cpp}
+/// sqlitepp::CheckpointManager manager("/path/to/database.sqlite");
+/// sqlitepp::Database database("/path/to/database.sqlite");
+/// database.execute("PRAGMA journal_mode=WAL;");
+/// manager.attach(&database);
+/// \endcode
+///
+/// \subsection deadlines Limiting the execution time
+/// To abort a query that takes too long, pass a deadline or a
+/// sqlitepp::CancellationToken to sqlitepp::Statement::execute. The limit
+/// also applies to the following calls of sqlitepp::ResultSet::next:
+/// \code{.cpp}
+/// auto deadline = std::chrono::steady_clock::now()
+///     + std::chrono::milliseconds(100);
+/// try {
+///   sqlitepp::ResultSet resultSet = statement->execute(deadline);
+///   // ...
+/// } catch (const sqlitepp::TimeoutError& e) {
+///   // the query took longer than 100 ms
+/// }
+/// \endcode
+///
+/// \subsection prefetch Reading ahead
+/// For long result sets, a sqlitepp::PrefetchCursor steps the statement on a
+/// separate thread while the rows are processed:
+/// \code{.cpp}
+/// std::shared_ptr<sqlitepp::Statement> statement = database.prepare(
+///     "SELECT id, value FROM test;");
+/// sqlitepp::PrefetchCursor cursor(statement);
+/// for (const sqlitepp::Row& row : cursor) {
+///   std::cout << row.readInt(0) << ": " << row.readString(1) << std::endl;
+/// }
+/// \endcode
+///
+/// \subsection plans Inspecting query plans
+/// sqlitepp::Database::explain returns the query plan of a statement. Tests
+/// can use sqlitepp::Database::setPlanCheck to reject all statements that
+/// scan large tables without an index:
+/// \code{.cpp}
+/// database.setPlanCheck(sqlitepp::PlanCheckAction::kReject, 1000);
+/// // throws a sqlitepp::QueryPlanError if test has more than 1000 rows and
+/// // there is no index on value
+/// database.prepare("SELECT id FROM test WHERE value = 'test';");
+/// \endcode
+///
+/// \subsection sharding Sharding
+/// A sqlitepp::ShardedDatabase distributes rows across several database
+/// files by a key. Its API mirrors sqlitepp::Database and
+/// sqlitepp::Statement:
+/// \code{.cpp}
+/// sqlitepp::ShardedDatabase database({"/path/to/shard0.sqlite",
+///                                     "/path/to/shard1.sqlite"});
+/// std::shared_ptr<sqlitepp::ShardedStatement> statement = database.prepare(
+///     "INSERT INTO test (id, value) VALUES (:id, :value);");
+/// statement->bind(":id", 1);
+/// statement->bind(":value", "test value");
+/// statement->execute(1);  // executed on the shard that owns the key 1
+/// \endcode
+///
+/// \subsection immutable Immutable databases
+/// Database files that are not changed while they are read, for example
+/// shipped reference data, can be opened with
+/// sqlitepp::Database::openImmutable. This skips locking and maps the file
+/// into memory:
+/// \code{.cpp}
+/// sqlitepp::Database database;
+/// database.openImmutable("/path/to/database.sqlite");
+/// \endcode
+///
 /// \section concepts Concepts
 /// \subsection error Error handling
 /// If an error occurs during an operation, an exception is thrown. All
@@ -100,10 +212,64 @@
 /// and sqlitepp::Statement take care of freeing their resources once they
 /// are destroyed. You can force them to free their resources using the
 /// `close` methods.
+///
+/// \subsection checks State checks
+/// sqlitepp::Database and sqlitepp::Statement always check whether they are
+/// open and throw a std::logic_error otherwise. The checks in the methods that
+/// are called for every binding or row, i. e. `bind` and `step` of
+/// sqlitepp::Statement and the accessors of sqlitepp::ResultSet, are
+/// controlled by the macro #SQLITEPP_CHECKED. If `NDEBUG` is defined, these
+/// checks are disabled and the `read*Type*` methods of sqlitepp::ResultSet
+/// are inlined to plain SQLite3 calls. In this case, calling these methods in
+/// a wrong state results in undefined behavior.
+
+/// \def SQLITEPP_CHECKED
+/// \brief Controls whether sqlitepp checks the state of its objects.
+///
+/// If this macro is set to a non-zero value, the per-row and per-binding
+/// methods that require a specific state throw a std::logic_error if the
+/// object is not in that state. If it is set to zero, these checks are
+/// skipped. If the macro is not defined, it defaults to zero if `NDEBUG` is
+/// defined and to one otherwise. The library and the code using it must be
+/// compiled with the same value.
+#ifndef SQLITEPP_CHECKED
+#ifdef NDEBUG
+#define SQLITEPP_CHECKED 0
+#else
+#define SQLITEPP_CHECKED 1
+#endif  // NDEBUG
+#endif  // SQLITEPP_CHECKED
+
+/// \def SQLITEPP_UNLIKELY
+/// \brief Marks a condition that is expected to be false.
+#if defined(__GNUC__)
+#define SQLITEPP_UNLIKELY(condition) __builtin_expect(!!(condition), 0)
+#else
+#define SQLITEPP_UNLIKELY(condition) (condition)
+#endif  // __GNUC__
 
 /// \brief Contains all classes of the sqlitepp library.
 namespace sqlitepp {
 
+/// \brief A check policy that enables all state checks.
+struct CheckedPolicy {
+  /// \brief `true` if state checks are performed.
+  static constexpr bool enabled = true;
+};
+
+/// \brief A check policy that disables all state checks.
+struct UncheckedPolicy {
+  /// \brief `true` if state checks are performed.
+  static constexpr bool enabled = false;
+};
+
+#if SQLITEPP_CHECKED
+/// \brief The check policy selected by #SQLITEPP_CHECKED.
+typedef CheckedPolicy CheckPolicy;
+#else
+typedef UncheckedPolicy CheckPolicy;
+#endif  // SQLITEPP_CHECKED
+
 /// \brief A class that forbids copying and assignments for all subclasses.
 ///
 /// This class defines a private, unimplemented copy constructor and assignment
@@ -130,7 +296,8 @@ class Uncopyable {
 ///
 /// Implementing classes may use setOpen() to change the state and
 /// requireOpen() to throw a std::logic_error if the object is currently not
-/// open.
+/// open. Hot paths may use requireOpenIfChecked() instead, which only performs
+/// the check if CheckPolicy is enabled.
 class Openable {
  public:
   /// \brief Checks whether this object is open.
@@ -154,7 +321,25 @@ class Openable {
   /// will contain the class name passed to the constructor.
   ///
   /// \throws std::logic_error if this object is not open
-  void requireOpen() const;
+  void requireOpen() const {
+    if (!m_open) {
+      throwNotOpen();
+    }
+  }
+
+  /// \brief Requires this object to be open if CheckPolicy is enabled.
+  ///
+  /// This method behaves like requireOpen() if CheckPolicy is enabled and does
+  /// nothing otherwise. It should only be used in methods that are called for
+  /// every row or binding.
+  ///
+  /// \throws std::logic_error if CheckPolicy is enabled and this object is not
+  ///         open
+  void requireOpenIfChecked() const {
+    if (CheckPolicy::enabled) {
+      requireOpen();
+    }
+  }
 
   /// \brief Changes the state of this object.
   ///
@@ -163,8 +348,10 @@ class Openable {
   void setOpen(const bool open);
 
  private:
+  [[noreturn]] void throwNotOpen() const;
+
   bool m_open;
-  const std::string& m_name;
+  const std::string m_name;
 };
 
 /// \brief An error that occurred during a database operation.
@@ -207,9 +394,272 @@ class DatabaseError : public std::runtime_error {
                                      const std::string& errorMessage);
 };
 
+/// \brief An error that occurs if a statement exceeded its deadline.
+///
+/// The error code of this error is `SQLITE_INTERRUPT`.
+///
+/// \sa Statement::execute(const Deadline&)
+class TimeoutError : public DatabaseError {
+ public:
+  /// \brief Creates a new TimeoutError.
+  TimeoutError();
+};
+
+/// \brief An error that occurs if a statement was cancelled using a
+///        CancellationToken.
+///
+/// The error code of this error is `SQLITE_INTERRUPT`.
+///
+/// \sa Statement::execute(const CancellationToken&)
+class CancelledError : public DatabaseError {
+ public:
+  /// \brief Creates a new CancelledError.
+  CancelledError();
+};
+
+/// \brief An error that occurs if a statement is rejected because of its
+///        query plan.
+///
+/// \sa Database::setPlanCheck
+class QueryPlanError : public std::runtime_error {
+ public:
+  /// \brief Creates a new QueryPlanError.
+  ///
+  /// \param sql the SQL string of the rejected statement
+  /// \param tables the tables that are scanned without an index
+  QueryPlanError(const std::string& sql,
+                 const std::vector<std::string>& tables);
+
+  /// \brief Returns the tables that are scanned without an index.
+  const std::vector<std::string>& tables() const;
+
+ private:
+  const std::vector<std::string> m_tables;
+
+  static std::string getErrorMessage(const std::string& sql,
+                                     const std::vector<std::string>& tables);
+};
+
+/// \brief The operation of a QueryPlanNode.
+enum class PlanOperation {
+  /// \brief A table or index is read completely (`SCAN`).
+  kScan,
+  /// \brief A table is searched using an index or key (`SEARCH`).
+  kSearch,
+  /// \brief A temporary B-tree is used for sorting or grouping.
+  kTempBTree,
+  /// \brief Any other operation, for example a subquery.
+  kOther
+};
+
+/// \brief A node of a query plan.
+///
+/// \sa Database::explain
+struct QueryPlanNode {
+  /// \brief The ID of this node reported by SQLite3.
+  int id;
+  /// \brief The ID of the parent node (zero for top-level nodes).
+  int parent;
+  /// \brief The description of this node reported by SQLite3.
+  std::string detail;
+  /// \brief The operation of this node.
+  PlanOperation operation;
+  /// \brief The table (or its alias) that is scanned or searched, if any.
+  std::string table;
+  /// \brief The index that is used, if any.
+  std::string index;
+  /// \brief `true` if the index is a covering index.
+  bool coveringIndex;
+  /// \brief `true` if the index is an automatic index created by SQLite3
+  ///        because there is no suitable index.
+  bool automaticIndex;
+  /// \brief `true` if the table is searched by its integer primary key.
+  bool primaryKey;
+  /// \brief The child nodes of this node.
+  std::vector<QueryPlanNode> children;
+
+  /// \brief Checks whether this node scans a table without an index.
+  ///
+  /// \returns `true` if this node is a scan of a table without an index
+  bool isFullScan() const;
+};
+
+/// \brief The query plan of a statement.
+///
+/// \sa Database::explain
+struct QueryPlan {
+  /// \brief The top-level nodes of the plan.
+  std::vector<QueryPlanNode> nodes;
+
+  /// \brief Returns the tables that are scanned without an index.
+  ///
+  /// \returns the names (or aliases) of all tables that are scanned without
+  ///          an index
+  std::vector<std::string> fullScans() const;
+
+  /// \brief Checks whether the plan uses a temporary B-tree.
+  ///
+  /// \returns `true` if a temporary B-tree is used for sorting or grouping
+  bool usesTempBTree() const;
+
+  /// \brief Returns a human-readable representation of the plan.
+  ///
+  /// \returns the details of all nodes, indented by their depth
+  std::string toString() const;
+};
+
+/// \brief The action taken if a prepared statement scans a large table
+///        without an index.
+///
+/// \sa Database::setPlanCheck
+enum class PlanCheckAction {
+  /// \brief Query plans are not checked.
+  kIgnore,
+  /// \brief The tables are reported by Statement::planWarnings.
+  kFlag,
+  /// \brief Database::prepare throws a QueryPlanError.
+  kReject
+};
+
+/// \brief The point in time after which a statement is aborted.
+typedef std::chrono::steady_clock::time_point Deadline;
+
+/// \brief A token that can be used to cancel statements from other threads.
+///
+/// Copies of a token share their state, so a token can be passed to
+/// Statement::execute(const CancellationToken&) and cancelled from another
+/// thread using a copy. All methods of this class are thread-safe.
+class CancellationToken {
+ public:
+  /// \brief Creates a new token that is not cancelled.
+  CancellationToken();
+
+  /// \brief Cancels all statements executed with this token.
+  ///
+  /// The statements are aborted with a CancelledError during their next
+  /// step.
+  void cancel();
+
+  /// \brief Checks whether this token has been cancelled.
+  ///
+  /// \returns `true` if cancel() has been called; otherwise `false`
+  bool isCancelled() const;
+
+ private:
+  std::shared_ptr<std::atomic<bool>> m_cancelled;
+};
+
 class Database;
 class ResultSet;
 
+/// \brief The kind of a row change reported by the change feed.
+enum class ChangeOperation {
+  /// \brief A row was inserted.
+  kInsert,
+  /// \brief A row was updated.
+  kUpdate,
+  /// \brief A row was deleted.
+  kDelete
+};
+
+/// \brief A row change reported by the change feed.
+///
+/// \sa Database::subscribeChanges
+struct Change {
+  /// \brief The kind of the change.
+  ChangeOperation operation;
+  /// \brief The name of the changed table.
+  std::string table;
+  /// \brief The row ID of the changed row.
+  sqlite3_int64 rowId;
+};
+
+/// \brief All changes of a committed transaction in the order they were made.
+typedef std::vector<Change> ChangeBatch;
+
+/// \brief A callback that is notified about committed changes.
+typedef std::function<void(const ChangeBatch&)> ChangeCallback;
+
+namespace detail {
+class CachedResult;
+class CheckpointState;
+class Connection;
+struct ValueView;
+}  // namespace detail
+
+/// \brief Statistics of the query cache of a Database.
+///
+/// \sa Database::enableQueryCache
+struct QueryCacheStats {
+  /// \brief The number of executions that were answered from the cache.
+  std::uint64_t hits;
+  /// \brief The number of cacheable executions that were not cached.
+  std::uint64_t misses;
+  /// \brief The number of entries removed because their tables changed.
+  std::uint64_t invalidations;
+  /// \brief The number of entries removed to stay within the capacity.
+  std::uint64_t evictions;
+  /// \brief The number of entries currently stored.
+  std::size_t entries;
+  /// \brief The approximate memory used by the stored entries in bytes.
+  std::size_t memoryUsage;
+  /// \brief The maximum memory that may be used by the cache in bytes.
+  std::size_t capacity;
+
+  /// \brief Returns the ratio of hits to all cacheable executions.
+  ///
+  /// \returns the hit rate between zero and one (zero if there were no
+  ///          cacheable executions)
+  double hitRate() const;
+};
+
+/// \brief A bounded queue of committed change batches.
+///
+/// This queue is filled by a Database the queue is subscribed to (see
+/// Database::subscribeChanges) and can be read from one other thread using
+/// pop(). The queue is lock-free, so the committing thread never waits for
+/// the consumer. If the queue is full, the batch is dropped and counted in
+/// droppedBatches(). A consumer that detects dropped batches has to
+/// resynchronize its state with the database.
+///
+/// The queue supports a single consumer thread. It may only be subscribed to
+/// one database.
+class ChangeQueue : private Uncopyable {
+ public:
+  /// \brief Creates a new empty queue.
+  ///
+  /// \param capacity the maximum number of batches stored in the queue
+  /// \throws std::invalid_argument if the capacity is zero
+  explicit ChangeQueue(const std::size_t capacity);
+
+  /// \brief Returns the maximum number of batches stored in the queue.
+  ///
+  /// \returns the capacity of this queue
+  std::size_t capacity() const;
+
+  /// \brief Returns the number of batches dropped because the queue was
+  ///        full.
+  ///
+  /// \returns the number of dropped batches
+  std::uint64_t droppedBatches() const;
+
+  /// \brief Removes the oldest batch from the queue.
+  ///
+  /// \param batch the pointer to store the removed batch in
+  /// \returns `true` if a batch was removed; `false` if the queue was empty
+  bool pop(std::shared_ptr<const ChangeBatch>* batch);
+
+ private:
+  bool push(const std::shared_ptr<const ChangeBatch>& batch);
+
+  std::vector<std::shared_ptr<const ChangeBatch>> m_slots;
+  alignas(64) std::atomic<std::size_t> m_head;
+  alignas(64) std::atomic<std::size_t> m_tail;
+  std::atomic<std::uint64_t> m_droppedBatches;
+
+  friend class detail::Connection;
+};
+
 /// \brief A handle for a SQLite3 statement.
 ///
 /// This class stores a reference to a prepared SQLite3 statement and provides
@@ -300,12 +750,70 @@ class Statement : private Uncopyable, public Openable {
 
   /// \brief Executes this statement and returns the result (if any).
   ///
+  /// If the query cache of the database was enabled when this statement was
+  /// prepared and the statement is read-only, the result is looked up in the
+  /// cache. If it is not cached yet, all rows are fetched and stored in the
+  /// cache.
+  ///
   /// \returns the result returned from the query (empty if there was no result)
   /// \throws std::logic_error if the statement is not open
   /// \throws DatabaseError if a database error occurs during the query
   ///         execution
   ResultSet execute();
 
+  /// \brief Executes this statement and aborts it after the given deadline.
+  ///
+  /// The deadline also applies to the following calls of ResultSet::next
+  /// until the statement is executed again. It is checked every few
+  /// thousand virtual machine instructions using a progress handler. If the
+  /// deadline is exceeded, a TimeoutError is thrown.
+  ///
+  /// \param deadline the point in time after which the statement is aborted
+  /// \returns the result returned from the query (empty if there was no result)
+  /// \throws std::logic_error if the statement is not open
+  /// \throws TimeoutError if the deadline is exceeded
+  /// \throws DatabaseError if a database error occurs during the query
+  ///         execution
+  ResultSet execute(const Deadline& deadline);
+
+  /// \brief Executes this statement and aborts it once the given token is
+  ///        cancelled.
+  ///
+  /// The token also applies to the following calls of ResultSet::next until
+  /// the statement is executed again. If the token is cancelled, a
+  /// CancelledError is thrown.
+  ///
+  /// \param token the token that cancels the statement
+  /// \returns the result returned from the query (empty if there was no result)
+  /// \throws std::logic_error if the statement is not open
+  /// \throws CancelledError if the token is cancelled
+  /// \throws DatabaseError if a database error occurs during the query
+  ///         execution
+  ResultSet execute(const CancellationToken& token);
+
+  /// \brief Executes this statement and aborts it after the given deadline or
+  ///        once the given token is cancelled.
+  ///
+  /// \param deadline the point in time after which the statement is aborted
+  /// \param token the token that cancels the statement
+  /// \returns the result returned from the query (empty if there was no result)
+  /// \throws std::logic_error if the statement is not open
+  /// \throws TimeoutError if the deadline is exceeded
+  /// \throws CancelledError if the token is cancelled
+  /// \throws DatabaseError if a database error occurs during the query
+  ///         execution
+  ResultSet execute(const Deadline& deadline, const CancellationToken& token);
+
+  /// \brief Returns the tables that this statement scans without an index.
+  ///
+  /// This list is only filled if the plan check of the database was set to
+  /// PlanCheckAction::kFlag when this statement was prepared.
+  ///
+  /// \returns the tables that are scanned without an index and have at least
+  ///          the minimum number of rows of the plan check
+  /// \sa Database::setPlanCheck
+  const std::vector<std::string>& planWarnings() const;
+
   /// \brief Resets the statement.
   ///
   /// Resets the statement so that it can be re-executed. Bindings are not
@@ -316,20 +824,41 @@ class Statement : private Uncopyable, public Openable {
   bool reset();
 
  private:
-  explicit Statement(sqlite3_stmt* handle);
+  Statement(sqlite3_stmt* handle,
+            const std::shared_ptr<detail::Connection>& connection);
 
+  ResultSet executeCached();
+  ResultSet executeLimited();
+  void checkLimits();
+  static int progressHandler(void* data);
   int getParameterIndex(const std::string& name) const;
   void handleBindResult(const int index, const int result) const;
-  void requireCanRead() const;
+  void recordBinding(const int index, std::string binding);
+  [[noreturn]] void throwCannotRead() const;
   void setInstancePointer(const std::weak_ptr<Statement>& instancePointer);
   bool step();
 
   sqlite3_stmt* m_handle;
   bool m_canRead;
   std::weak_ptr<Statement> m_instancePointer;
+  std::shared_ptr<detail::Connection> m_connection;
+  bool m_readOnly;
+  bool m_tracked;
+  bool m_changesSchema;
+  std::string m_savepointOperation;
+  std::string m_savepointName;
+  std::vector<std::string> m_readTables;
+  std::vector<std::string> m_writeTables;
+  std::vector<std::string> m_bindings;
+  bool m_hasDeadline;
+  Deadline m_deadline;
+  std::unique_ptr<CancellationToken> m_token;
+  std::vector<std::string> m_planWarnings;
 
   friend class Database;
+  friend class PrefetchCursor;
   friend class ResultSet;
+  friend class ShardedStatement;
 };
 
 /// \brief A handle for a SQLite3 database.
@@ -371,11 +900,50 @@ class Database : private Uncopyable, public Openable {
   /// Errors that occur closing the database are ignored.
   ~Database();
 
+  /// \brief Removes all entries from the query cache.
+  ///
+  /// If the query cache is not enabled, this method does nothing.
+  void clearQueryCache();
+
   /// \brief Closes the database if it is open.
   ///
-  /// \throws DatabaseError if the database cannot be closed
+  /// If the database cannot be closed, it stays open and keeps its query
+  /// cache, change subscriptions and checkpoint manager.
+  ///
+  /// \throws DatabaseError if the database cannot be closed, for example
+  ///         because a statement is still open
   void close();
 
+  /// \brief Disables the query cache and frees all cached results.
+  ///
+  /// If the query cache is not enabled, this method does nothing.
+  ///
+  /// \throws std::logic_error if the database is not open
+  void disableQueryCache();
+
+  /// \brief Enables the query cache for statements prepared afterwards.
+  ///
+  /// Once the cache is enabled, the results of read-only statements that read
+  /// from at least one table are stored in the cache, keyed by their SQL string
+  /// and the bound values. If the same statement is executed again with the
+  /// same values, the result is read from the cache without stepping the
+  /// statement.
+  ///
+  /// Entries are invalidated if one of the tables they read from is changed by
+  /// this connection, if a transaction is rolled back, if the schema is
+  /// changed or if `PRAGMA data_version` indicates a change by another
+  /// connection. If the cache exceeds the given capacity, the least recently
+  /// used entries are removed. Results of non-deterministic functions like
+  /// `random()` are cached as well.
+  ///
+  /// If the cache is already enabled, its capacity is changed.
+  ///
+  /// \param capacity the maximum memory used by the cache in bytes
+  /// \throws std::logic_error if the database is not open
+  /// \throws DatabaseError if an error occurred during the preparation of the
+  ///         data version query
+  void enableQueryCache(const std::size_t capacity);
+
   /// \brief Executes the given SQL string.
   ///
   /// You can only call this method if there is an open database connection.
@@ -387,6 +955,26 @@ class Database : private Uncopyable, public Openable {
   /// \throws DatabaseError if an error occurred during the execution
   void execute(const std::string& sql);
 
+  /// \brief Returns the query plan of the given SQL statement.
+  ///
+  /// The plan is determined using `EXPLAIN QUERY PLAN`. The statement is not
+  /// executed.
+  ///
+  /// \param sql the SQL statement to explain (may contain wildcards)
+  /// \returns the query plan of the statement
+  /// \throws std::logic_error if the database is not open
+  /// \throws DatabaseError if an error occurred during the preparation
+  QueryPlan explain(const std::string& sql);
+
+  /// \brief Aborts all statements that are currently running on this
+  ///        connection.
+  ///
+  /// This method may be called from any thread. The running statements fail
+  /// with a DatabaseError with the code `SQLITE_INTERRUPT`.
+  ///
+  /// \throws std::logic_error if the database is not open
+  void interrupt();
+
   /// \brief Returns the row ID of the last element that was inserted.
   ///
   /// If no entry has been inserted into the database, this method returns
@@ -411,6 +999,41 @@ class Database : private Uncopyable, public Openable {
   /// \throws DatabaseError if the SQLite3 database could not be opened
   void open(const std::string& file);
 
+  /// \brief Opens the given database file using the given flags.
+  ///
+  /// The flags are passed to \c sqlite3_open_v2, for example
+  /// \c SQLITE_OPEN_READONLY or \c SQLITE_OPEN_URI.
+  ///
+  /// \param file the name or the URI of the database file
+  /// \param flags the \c SQLITE_OPEN_* flags for the connection
+  /// \throws std::logic_error if the database is already open
+  /// \throws std::runtime_error if there is not enough memory to create a
+  ///         database connection
+  /// \throws DatabaseError if the SQLite3 database could not be opened
+  void open(const std::string& file, const int flags);
+
+  /// \brief Opens the given database file as an immutable, read-only
+  ///        database.
+  ///
+  /// The file is opened with the URI parameters \c mode=ro and
+  /// \c immutable=1 and read using memory-mapped I/O. SQLite3 does not lock
+  /// immutable databases and does not check whether they have been changed,
+  /// so the file must not be modified while it is open. The query cache does
+  /// not check the data version for immutable databases.
+  ///
+  /// Each connection maps the file separately, but the mapped pages are
+  /// shared through the page cache of the operating system. Thus, several
+  /// reader connections can open the same file without copying its pages.
+  ///
+  /// \param file the name of the database file (must exist)
+  /// \param mmapSize the maximum number of bytes to map into memory
+  /// \throws std::logic_error if the database is already open
+  /// \throws std::runtime_error if there is not enough memory to create a
+  ///         database connection
+  /// \throws DatabaseError if the SQLite3 database could not be opened
+  void openImmutable(const std::string& file,
+                     const sqlite3_int64 mmapSize = 1024 * 1024 * 1024);
+
   /// \brief Prepares a statement and returns a pointer to it.
   ///
   /// You can either pass a complete SQL statement or a statement with
@@ -423,14 +1046,94 @@ class Database : private Uncopyable, public Openable {
   /// \throws DatabaseError if an error occurred during the preparation
   std::shared_ptr<Statement> prepare(const std::string& sql);
 
+  /// \brief Sets the check for the query plans of prepared statements.
+  ///
+  /// If the action is not PlanCheckAction::kIgnore, prepare() determines the
+  /// query plan of each statement and looks for tables that are scanned
+  /// without an index. Tables are only considered if they have at least the
+  /// given number of rows. The row count is read from `sqlite_stat1` if
+  /// `ANALYZE` has been run and counted otherwise. Aliases in the plan are
+  /// mapped to their tables; scans of CTEs and subqueries are not
+  /// considered.
+  ///
+  /// This check is intended for tests and adds considerable overhead to
+  /// prepare().
+  ///
+  /// \param action the action to take for statements with full scans
+  /// \param minimumRows the minimum row count of tables to consider
+  /// \throws std::logic_error if the database is not open
+  void setPlanCheck(const PlanCheckAction action,
+                    const sqlite3_int64 minimumRows = 0);
+
+  /// \brief Subscribes the given callback to all committed changes.
+  ///
+  /// Once a transaction that changed rows of a rowid table was committed on
+  /// this connection, the callback is called with the changes of that
+  /// transaction. It is called on the committing thread after the commit
+  /// completed, so it may use this database. Changes of transactions that
+  /// were rolled back, of statements that SQLite3 rolled back after an error
+  /// and of savepoints undone using `ROLLBACK TO` are not reported. Changes
+  /// kept by an `ON CONFLICT FAIL` error are reported. Savepoints are only
+  /// tracked for statements prepared while the connection has a subscriber
+  /// or a query cache. The callback must not throw exceptions.
+  ///
+  /// \param callback the callback to notify about committed changes
+  /// \returns the ID of the subscription (see unsubscribeChanges)
+  /// \throws std::logic_error if the database is not open
+  /// \throws std::invalid_argument if the callback is empty
+  int subscribeChanges(const ChangeCallback& callback);
+
+  /// \brief Subscribes the given queue to all committed changes.
+  ///
+  /// This method works like subscribeChanges(const ChangeCallback&), but the
+  /// batches are pushed to the given queue instead. If the queue is full,
+  /// the batch is dropped.
+  ///
+  /// \param queue the queue to push committed changes to
+  /// \returns the ID of the subscription (see unsubscribeChanges)
+  /// \throws std::logic_error if the database is not open
+  /// \throws std::invalid_argument if the queue is empty
+  int subscribeChanges(const std::shared_ptr<ChangeQueue>& queue);
+
+  /// \brief Cancels the subscription with the given ID.
+  ///
+  /// If there is no subscription with the given ID, this method does
+  /// nothing.
+  ///
+  /// \param subscription the ID returned by subscribeChanges
+  /// \throws std::logic_error if the database is not open
+  void unsubscribeChanges(const int subscription);
+
+  /// \brief Returns the statistics of the query cache.
+  ///
+  /// If the query cache is not enabled, all values are zero.
+  ///
+  /// \returns the current statistics of the query cache
+  QueryCacheStats queryCacheStats() const;
+
  private:
+  std::vector<std::string> checkPlan(const std::string& sql);
+  std::shared_ptr<Statement> prepareStatement(const std::string& sql,
+                                              const bool checkPlan);
+  std::vector<std::string> readTables(const std::string& sql);
+  sqlite3_int64 tableRowCount(const std::string& table);
+
   sqlite3* m_handle;
+  std::shared_ptr<detail::Connection> m_connection;
+  PlanCheckAction m_planCheckAction;
+  sqlite3_int64 m_planCheckMinimumRows;
+
+  friend class CheckpointManager;
 };
 
 /// \brief A result set returned from a SQL query.
 ///
 /// As long as there is data (`canRead()`), you can read it using the
 /// `read*Type*` methods. To advance to the next row, use `next()`.
+///
+/// The `read*Type*` methods and columnCount() are defined inline. If
+/// #SQLITEPP_CHECKED is zero, they compile down to the according
+/// `sqlite3_column_*` calls.
 class ResultSet {
  public:
   /// \brief Checks whether there is data to read.
@@ -447,6 +1150,19 @@ class ResultSet {
   ///         data to read
   int columnCount() const;
 
+  /// \brief Returns the SQLite3 type of the current value of the result
+  ///        column with the given index.
+  ///
+  /// You may only call this method when there is data to read (canRead()).
+  ///
+  /// \param column the index of the column to read from
+  /// \returns the type of the current value (`SQLITE_INTEGER`, `SQLITE_FLOAT`,
+  ///          `SQLITE_TEXT`, `SQLITE_BLOB` or `SQLITE_NULL`)
+  /// \throws std::logic_error if the statement is not open or there is no
+  ///         data to read
+  /// \sa [Fundamental Datatypes](https://www.sqlite.org/c3ref/c_blob.html)
+  int columnType(const int column) const;
+
   /// \brief Steps to the next row of the result (if there is one).
   ///
   /// \returns `true` if there is new data to read or `false` if there are
@@ -491,12 +1207,645 @@ class ResultSet {
 
  private:
   explicit ResultSet(const std::shared_ptr<Statement> statement);
+  ResultSet(const std::shared_ptr<Statement> statement,
+            const std::shared_ptr<const detail::CachedResult>& cached,
+            const bool partial);
+
+  int readCachedType(const int column) const;
+  double readCachedDouble(const int column) const;
+  int readCachedInt(const int column) const;
+  std::string readCachedString(const int column) const;
+
+  void requireCanRead() const {
+    m_statement->requireOpenIfChecked();
+    if (CheckPolicy::enabled && !canRead()) {
+      m_statement->throwCannotRead();
+    }
+  }
 
   const std::shared_ptr<Statement> m_statement;
+  std::shared_ptr<const detail::CachedResult> m_cached;
+  std::size_t m_row;
+  std::size_t m_rowCount;
+  int m_cachedColumnCount;
+  bool m_partial;
 
   friend class Statement;
 };
 
+inline bool ResultSet::canRead() const {
+  if (SQLITEPP_UNLIKELY(m_cached)) {
+    return m_row < m_rowCount;
+  }
+  return m_statement->m_canRead;
+}
+
+inline int ResultSet::columnCount() const {
+  requireCanRead();
+  if (SQLITEPP_UNLIKELY(m_cached)) {
+    return m_cachedColumnCount;
+  }
+  return sqlite3_data_count(m_statement->m_handle);
+}
+
+inline int ResultSet::columnType(const int column) const {
+  requireCanRead();
+  if (SQLITEPP_UNLIKELY(m_cached)) {
+    return readCachedType(column);
+  }
+  return sqlite3_column_type(m_statement->m_handle, column);
+}
+
+inline double ResultSet::readDouble(const int column) const {
+  requireCanRead();
+  if (SQLITEPP_UNLIKELY(m_cached)) {
+    return readCachedDouble(column);
+  }
+  return sqlite3_column_double(m_statement->m_handle, column);
+}
+
+inline int ResultSet::readInt(const int column) const {
+  requireCanRead();
+  if (SQLITEPP_UNLIKELY(m_cached)) {
+    return readCachedInt(column);
+  }
+  return sqlite3_column_int(m_statement->m_handle, column);
+}
+
+inline std::string ResultSet::readString(const int column) const {
+  requireCanRead();
+  if (SQLITEPP_UNLIKELY(m_cached)) {
+    return readCachedString(column);
+  }
+  const unsigned char* text = sqlite3_column_text(m_statement->m_handle,
+                                                  column);
+  if (text == NULL) {
+    return std::string();
+  }
+  return std::string(reinterpret_cast<const char*>(text),
+                     sqlite3_column_bytes(m_statement->m_handle, column));
+}
+
+/// \brief A decoded row of a PrefetchCursor.
+///
+/// A row stores copies of the values of one result row, so it can be read
+/// independently of the statement. The rows are reused by the cursor; the
+/// reference returned by the cursor is only valid until it is advanced.
+class Row {
+ public:
+  /// \brief Returns the column count of this row.
+  ///
+  /// \returns the column count of this row
+  int columnCount() const;
+
+  /// \brief Returns the SQLite3 type of the column with the given index.
+  ///
+  /// \param column the index of the column to read from
+  /// \returns the type of the value (`SQLITE_NULL` if the column does not
+  ///          exist)
+  int columnType(const int column) const;
+
+  /// \brief Returns the double value of the column with the given index.
+  ///
+  /// \param column the index of the column to read from
+  /// \returns the value of the column (zero if the column does not exist)
+  double readDouble(const int column) const;
+
+  /// \brief Returns the integer value of the column with the given index.
+  ///
+  /// \param column the index of the column to read from
+  /// \returns the value of the column (zero if the column does not exist)
+  int readInt(const int column) const;
+
+  /// \brief Returns the string value of the column with the given index.
+  ///
+  /// Values of other types are converted to strings like SQLite3 does.
+  ///
+  /// \param column the index of the column to read from
+  /// \returns the value of the column (empty if the column does not exist)
+  std::string readString(const int column) const;
+
+ private:
+  struct Value {
+    int type;
+    sqlite3_int64 integer;
+    double real;
+    std::string text;
+  };
+
+  void assign(sqlite3_stmt* handle);
+  detail::ValueView view(const int column) const;
+
+  std::vector<Value> m_values;
+
+  friend class PrefetchCursor;
+};
+
+/// \brief A cursor that steps a statement on a separate thread.
+///
+/// The cursor starts a producer thread that executes the statement and
+/// copies the rows into a bounded ring buffer. The rows are read from the
+/// buffer by iterating over the cursor, so that stepping the statement and
+/// processing the rows overlap. The slots of the buffer are reused, so
+/// reading a row does not allocate memory once the buffer is warm.
+///
+/// The cursor may only be iterated once, from one thread. While the cursor
+/// is active, the statement and its database must not be used by other
+/// code. If an error occurs while stepping the statement, it is rethrown
+/// when the cursor is advanced to the row that could not be read.
+class PrefetchCursor : private Uncopyable {
+ public:
+  /// \brief An input iterator over the rows of a PrefetchCursor.
+  class iterator {
+   public:
+    /// \brief The category of this iterator.
+    typedef std::input_iterator_tag iterator_category;
+    /// \brief The type of the elements.
+    typedef const Row value_type;
+    /// \brief The type of the distance between two iterators.
+    typedef std::ptrdiff_t difference_type;
+    /// \brief A pointer to an element.
+    typedef const Row* pointer;
+    /// \brief A reference to an element.
+    typedef const Row& reference;
+
+    /// \brief Returns the current row.
+    const Row& operator*() const;
+
+    /// \brief Returns a pointer to the current row.
+    const Row* operator->() const;
+
+    /// \brief Advances to the next row.
+    ///
+    /// \throws DatabaseError if an error occurred while stepping the
+    ///         statement
+    iterator& operator++();
+
+    /// \brief Checks whether two iterators point to the same position.
+    bool operator==(const iterator& other) const;
+
+    /// \brief Checks whether two iterators point to different positions.
+    bool operator!=(const iterator& other) const;
+
+   private:
+    explicit iterator(PrefetchCursor* cursor);
+
+    PrefetchCursor* m_cursor;
+
+    friend class PrefetchCursor;
+  };
+
+  /// \brief Creates a new cursor and starts stepping the given statement.
+  ///
+  /// The statement must be bound and may not have been executed since its
+  /// last reset.
+  ///
+  /// \param statement the statement to read from
+  /// \param capacity the number of rows buffered ahead of the consumer
+  /// \throws std::logic_error if the statement is not open
+  /// \throws std::invalid_argument if the capacity is zero
+  explicit PrefetchCursor(const std::shared_ptr<Statement>& statement,
+                          const std::size_t capacity = 256);
+
+  /// \brief Stops the producer thread.
+  ///
+  /// If the producer is currently stepping the statement, the destructor
+  /// waits until that step completed.
+  ~PrefetchCursor();
+
+  /// \brief Returns an iterator to the first row.
+  ///
+  /// \throws DatabaseError if an error occurred while stepping the
+  ///         statement
+  iterator begin();
+
+  /// \brief Returns the end iterator.
+  iterator end();
+
+ private:
+  bool advance();
+  void produce();
+  bool waitForRow();
+  bool waitForSlot();
+
+  const std::shared_ptr<Statement> m_statement;
+  std::vector<Row> m_slots;
+  alignas(64) std::atomic<std::size_t> m_head;
+  alignas(64) std::atomic<std::size_t> m_tail;
+  std::atomic<bool> m_done;
+  std::atomic<bool> m_stopped;
+  std::atomic<bool> m_consumerWaiting;
+  std::atomic<bool> m_producerWaiting;
+  std::mutex m_mutex;
+  std::condition_variable m_rowAvailable;
+  std::condition_variable m_slotAvailable;
+  std::exception_ptr m_error;
+  bool m_started;
+  bool m_hasRow;
+  std::thread m_thread;
+};
+
+/// \brief Statistics of a CheckpointManager.
+struct CheckpointStats {
+  /// \brief The number of frames in the WAL as reported by the last commit.
+  int walFrames;
+  /// \brief The size of the WAL file in bytes as reported by the last commit.
+  std::int64_t walBytes;
+  /// \brief The number of passive checkpoints that were run.
+  std::uint64_t passiveCheckpoints;
+  /// \brief The number of truncating checkpoints run in idle windows.
+  std::uint64_t truncateCheckpoints;
+  /// \brief The number of checkpoints that could not complete because the
+  ///        database was busy.
+  std::uint64_t busyCheckpoints;
+  /// \brief The number of checkpoints that failed with another error.
+  std::uint64_t failedCheckpoints;
+  /// \brief The duration of the last checkpoint.
+  std::chrono::microseconds lastDuration;
+  /// \brief The duration of the longest checkpoint.
+  std::chrono::microseconds maxDuration;
+  /// \brief The summed duration of all checkpoints.
+  std::chrono::microseconds totalDuration;
+};
+
+/// \brief Runs WAL checkpoints on a background thread.
+///
+/// If a database is in WAL mode, SQLite3 per default runs a checkpoint as
+/// part of the commit that lets the WAL grow beyond 1000 pages. The commit
+/// that triggers the checkpoint has to wait for it. A CheckpointManager
+/// disables these automatic checkpoints for all attached connections and
+/// runs them on its own thread and connection instead.
+///
+/// If the WAL has grown by more than the frame threshold, the manager runs a
+/// passive checkpoint that does not wait for readers or writers. If there
+/// were no commits for the idle interval, it runs a truncating checkpoint
+/// that resets the WAL file. The attached connections report the WAL size
+/// after each commit so that the manager can react immediately.
+///
+/// All connections that write to the database file should be attached to
+/// the manager. Otherwise, they still run automatic checkpoints.
+class CheckpointManager : private Uncopyable {
+ public:
+  /// \brief Creates a new manager for the given file and starts its thread.
+  ///
+  /// \param file the name of the database file
+  /// \param frameThreshold the WAL size in frames that triggers a passive
+  ///        checkpoint
+  /// \param idleInterval the time without commits after which a truncating
+  ///        checkpoint is run
+  /// \throws std::invalid_argument if the frame threshold or the idle
+  ///         interval is not positive
+  /// \throws std::runtime_error if there is not enough memory to create a
+  ///         database connection
+  /// \throws DatabaseError if the SQLite3 database could not be opened
+  explicit CheckpointManager(const std::string& file,
+      const int frameThreshold = 1000,
+      const std::chrono::milliseconds idleInterval
+          = std::chrono::milliseconds(1000));
+
+  /// \brief Stops the thread of this manager.
+  ///
+  /// The automatic checkpoints of the attached connections are restored.
+  ~CheckpointManager();
+
+  /// \brief Attaches the given database to this manager.
+  ///
+  /// Disables the automatic checkpoints of the database and registers a WAL
+  /// hook that reports the WAL size to this manager. The database must be
+  /// connected to the same file as this manager.
+  ///
+  /// \param database the database to attach
+  /// \throws std::logic_error if the database is not open or if this manager
+  ///         has been stopped
+  void attach(Database* database);
+
+  /// \brief Returns the current statistics of this manager.
+  ///
+  /// This method may be called from any thread.
+  ///
+  /// \returns the current checkpoint statistics
+  CheckpointStats stats() const;
+
+  /// \brief Stops the thread of this manager.
+  ///
+  /// Removes the WAL hooks of the attached connections that are still open
+  /// and restores their automatic checkpoints. If the thread has already been
+  /// stopped, this method does nothing.
+  void stop();
+
+ private:
+  void run();
+
+  std::shared_ptr<detail::CheckpointState> m_state;
+  Database m_database;
+  const std::chrono::milliseconds m_idleInterval;
+  std::thread m_thread;
+};
+
+/// \brief The combined result of a statement executed on all shards of a
+///        ShardedDatabase.
+///
+/// This class provides the same methods as ResultSet. The rows of the shards
+/// are either read one shard after another or, if a merge column is set,
+/// merged so that the values of that column are in ascending order. For a
+/// merge, the result of each shard must already be ordered by that column.
+class ShardedResultSet {
+ public:
+  /// \brief Checks whether there is data to read.
+  ///
+  /// \returns `true` if there is data to read; otherwise `false`
+  bool canRead() const;
+
+  /// \brief Returns the column count of the result data.
+  ///
+  /// \returns the column count of the result
+  /// \throws std::logic_error if there is no data to read
+  int columnCount() const;
+
+  /// \brief Returns the index of the shard the current row was read from.
+  ///
+  /// \returns the index of the shard of the current row
+  /// \throws std::logic_error if there is no data to read
+  std::size_t currentShard() const;
+
+  /// \brief Steps to the next row of the result (if there is one).
+  ///
+  /// \returns `true` if there is new data to read or `false` if there are
+  ///          no more results
+  /// \throws DatabaseError if a database error occurs during the query
+  ///         execution
+  bool next();
+
+  /// \brief Returns the current double value of the result column with the
+  ///        given index.
+  ///
+  /// \param column the index of the column to read from
+  /// \returns the current value of the result column with the given index
+  /// \throws std::logic_error if there is no data to read
+  double readDouble(const int column) const;
+
+  /// \brief Returns the current integer value of the result column with the
+  ///        given index.
+  ///
+  /// \param column the index of the column to read from
+  /// \returns the current value of the result column with the given index
+  /// \throws std::logic_error if there is no data to read
+  int readInt(const int column) const;
+
+  /// \brief Returns the current string value of the result column with the
+  ///        given index.
+  ///
+  /// \param column the index of the column to read from
+  /// \returns the current value of the result column with the given index
+  /// \throws std::logic_error if there is no data to read
+  std::string readString(const int column) const;
+
+ private:
+  ShardedResultSet(const std::vector<ResultSet>& resultSets,
+                   const int mergeColumn);
+
+  const ResultSet& current() const;
+  void selectCurrent();
+
+  std::vector<ResultSet> m_resultSets;
+  const int m_mergeColumn;
+  std::size_t m_current;
+
+  friend class ShardedStatement;
+};
+
+/// \brief A statement that is prepared on all shards of a ShardedDatabase.
+///
+/// The bind methods work like the methods of Statement. The bound values are
+/// stored and only bound to the statement of the shard that executes it.
+/// Use execute(const std::string&) to execute the statement on the shard
+/// that owns the given key, or executeAll() to execute it on all shards.
+///
+/// Use ShardedDatabase::prepare to obtain instances of this class.
+class ShardedStatement : private Uncopyable {
+ public:
+  /// \brief Binds the given double value to the column with the given index.
+  ///
+  /// \param index the index of the column to bind the value to
+  /// \param value the value to bind to that column
+  /// \throws std::out_of_range if the given index is out of range
+  void bind(const int index, const double value);
+
+  /// \brief Binds the given double value to the column with the given name.
+  ///
+  /// \param name the name of the column to bind the value to
+  /// \param value the value to bind to that column
+  /// \throws std::logic_error if the statement is not open
+  /// \throws std::invalid_argument if there is no column with the given name
+  void bind(const std::string& name, const double value);
+
+  /// \brief Binds the given integer value to the column with the given index.
+  ///
+  /// \param index the index of the column to bind the value to
+  /// \param value the value to bind to that column
+  /// \throws std::out_of_range if the given index is out of range
+  void bind(const int index, const int value);
+
+  /// \brief Binds the given integer value to the column with the given name.
+  ///
+  /// \param name the name of the column to bind the value to
+  /// \param value the value to bind to that column
+  /// \throws std::logic_error if the statement is not open
+  /// \throws std::invalid_argument if there is no column with the given name
+  void bind(const std::string& name, const int value);
+
+  /// \brief Binds the given string value to the column with the given index.
+  ///
+  /// \param index the index of the column to bind the value to
+  /// \param value the value to bind to that column
+  /// \throws std::out_of_range if the given index is out of range
+  void bind(const int index, const std::string& value);
+
+  /// \brief Binds the given string value to the column with the given name.
+  ///
+  /// \param name the name of the column to bind the value to
+  /// \param value the value to bind to that column
+  /// \throws std::logic_error if the statement is not open
+  /// \throws std::invalid_argument if there is no column with the given name
+  void bind(const std::string& name, const std::string& value);
+
+  /// \brief Closes the statements on all shards.
+  void close();
+
+  /// \brief Executes this statement on the shard that owns the given key.
+  ///
+  /// \param key the key that determines the shard (see
+  ///        ShardedDatabase::shardFor)
+  /// \returns the result returned from the query (empty if there was no result)
+  /// \throws std::logic_error if the statement is not open
+  /// \throws DatabaseError if a database error occurs during the query
+  ///         execution
+  ResultSet execute(const std::string& key);
+
+  /// \brief Executes this statement on the shard that owns the given key.
+  ///
+  /// \param key the key that determines the shard (see
+  ///        ShardedDatabase::shardFor)
+  /// \returns the result returned from the query (empty if there was no result)
+  /// \throws std::logic_error if the statement is not open
+  /// \throws DatabaseError if a database error occurs during the query
+  ///         execution
+  ResultSet execute(const sqlite3_int64 key);
+
+  /// \brief Executes this statement on all shards and concatenates the
+  ///        results.
+  ///
+  /// \returns the results of all shards, one shard after another
+  /// \throws std::logic_error if the statement is not open
+  /// \throws DatabaseError if a database error occurs during the query
+  ///         execution
+  ShardedResultSet executeAll();
+
+  /// \brief Executes this statement on all shards and merges the results by
+  ///        the given column.
+  ///
+  /// The results of the shards must be ordered ascending by the given column,
+  /// for example using an `ORDER BY` clause. The merged result is then
+  /// ordered by this column as well. Numbers are compared as doubles; NULL
+  /// values are smaller than numbers and numbers are smaller than strings.
+  ///
+  /// \param column the index of the column to merge the results by
+  /// \returns the merged results of all shards
+  /// \throws std::logic_error if the statement is not open
+  /// \throws DatabaseError if a database error occurs during the query
+  ///         execution
+  ShardedResultSet executeMerged(const int column);
+
+  /// \brief Resets the statements on all shards.
+  ///
+  /// \returns `true` if all resets were successful; otherwise `false`
+  /// \throws std::logic_error if the statement is not open
+  bool reset();
+
+ private:
+  struct Binding {
+    int index;
+    int type;
+    int integer;
+    double real;
+    std::string text;
+  };
+
+  explicit ShardedStatement(
+      const std::vector<std::shared_ptr<Statement>>& statements);
+
+  void applyBindings(const std::size_t shard);
+  Binding& binding(const int index);
+  int getParameterIndex(const std::string& name) const;
+
+  std::vector<std::shared_ptr<Statement>> m_statements;
+  std::vector<Binding> m_bindings;
+
+  friend class ShardedDatabase;
+};
+
+/// \brief A set of SQLite3 databases that are used as shards of one logical
+///        database.
+///
+/// Each shard is a separate database file with its own writer, so writes to
+/// different shards do not block each other. Rows are assigned to shards by
+/// a key using a stable hash function (see shardFor). All shards should have
+/// the same schema; use execute(const std::string&) to change it.
+///
+/// Transactions started with begin() are run on every shard. They are atomic
+/// per shard, but not across shards: if the commit fails on one shard, the
+/// shards that were already committed keep their changes.
+class ShardedDatabase : private Uncopyable {
+ public:
+  /// \brief Creates a new sharded database and opens the given files.
+  ///
+  /// The order of the files determines the assignment of keys to shards and
+  /// must not change once data has been written.
+  ///
+  /// \param files the names of the shard database files
+  /// \throws std::invalid_argument if the list of files is empty
+  /// \throws std::runtime_error if there is not enough memory to create a
+  ///         database connection
+  /// \throws DatabaseError if a SQLite3 database could not be opened
+  explicit ShardedDatabase(const std::vector<std::string>& files);
+
+  /// \brief Starts a transaction on all shards.
+  ///
+  /// \throws std::logic_error if the database is not open
+  /// \throws DatabaseError if the transaction could not be started on one of
+  ///         the shards (the transactions on the other shards are rolled back)
+  void begin();
+
+  /// \brief Closes all shards.
+  ///
+  /// \throws DatabaseError if a shard cannot be closed
+  void close();
+
+  /// \brief Commits the transactions on all shards.
+  ///
+  /// The shards are committed one after another. If the commit fails on one
+  /// shard, the transactions of the remaining shards are rolled back.
+  ///
+  /// \throws std::logic_error if the database is not open
+  /// \throws DatabaseError if the commit failed on one of the shards
+  void commit();
+
+  /// \brief Executes the given SQL string on all shards.
+  ///
+  /// \param sql the SQL statement to execute
+  /// \throws std::logic_error if the database is not open
+  /// \throws DatabaseError if an error occurred during the execution
+  void execute(const std::string& sql);
+
+  /// \brief Prepares a statement on all shards.
+  ///
+  /// \param sql the SQL statement to prepare (may contain wildcards)
+  /// \returns a pointer to the prepared statement
+  /// \throws std::logic_error if the database is not open
+  /// \throws DatabaseError if an error occurred during the preparation
+  std::shared_ptr<ShardedStatement> prepare(const std::string& sql);
+
+  /// \brief Rolls back the transactions on all shards.
+  ///
+  /// \throws std::logic_error if the database is not open
+  /// \throws DatabaseError if the rollback failed on one of the shards
+  void rollback();
+
+  /// \brief Returns the shard with the given index.
+  ///
+  /// \param index the index of the shard
+  /// \returns the database of the shard
+  /// \throws std::out_of_range if the index is out of range
+  Database& shard(const std::size_t index);
+
+  /// \brief Returns the number of shards.
+  ///
+  /// \returns the number of shards
+  std::size_t shardCount() const;
+
+  /// \brief Returns the index of the shard that owns the given key.
+  ///
+  /// The index is calculated using the 64-bit FNV-1a hash of the key, so it
+  /// is stable across platforms and program runs.
+  ///
+  /// \param key the key to look up
+  /// \returns the index of the shard for the key
+  std::size_t shardFor(const std::string& key) const;
+
+  /// \brief Returns the index of the shard that owns the given key.
+  ///
+  /// The index is calculated using the 64-bit FNV-1a hash of the
+  /// little-endian bytes of the key, so it is stable across platforms and
+  /// program runs.
+  ///
+  /// \param key the key to look up
+  /// \returns the index of the shard for the key
+  std::size_t shardFor(const sqlite3_int64 key) const;
+
+ private:
+  std::vector<std::unique_ptr<Database>> m_shards;
+};
+
 }  // namespace sqlitepp
 
 #endif  // SQLITEPP_SQLITEPP_H_
@@ -2,10 +2,23 @@
 // MIT license -- http://opensource.org/licenses/MIT
 
 #include "sqlitepp/sqlitepp.h"
+#include <algorithm>
+#include <condition_variable>  // NOLINT(build/c++11)
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <exception>
 #include <iostream>
+#include <limits>
+#include <list>
+#include <mutex>  // NOLINT(build/c++11)
 #include <sstream>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 namespace sqlitepp {
 
@@ -17,10 +30,8 @@ bool Openable::isOpen() const {
   return m_open;
 }
 
-void Openable::requireOpen() const {
-  if (!m_open) {
-    throw std::logic_error(m_name + " is not open.");
-  }
+void Openable::throwNotOpen() const {
+  throw std::logic_error(m_name + " is not open.");
 }
 
 void Openable::setOpen(const bool open) {
@@ -49,221 +60,2280 @@ int DatabaseError::errorCode() const {
   return m_errorCode;
 }
 
-Statement::Statement(sqlite3_stmt* handle)
-    : Openable(true, "Statement"), m_canRead(false), m_handle(handle) {
+QueryPlanError::QueryPlanError(const std::string& sql,
+                               const std::vector<std::string>& tables)
+    : std::runtime_error(getErrorMessage(sql, tables)), m_tables(tables) {
 }
 
-Statement::~Statement() {
-  if (isOpen()) {
-    // errors that could occur during finalizing are ignored as they have
-    // already been handled!
-    sqlite3_finalize(m_handle);
-    setOpen(false);
-  }
+const std::vector<std::string>& QueryPlanError::tables() const {
+  return m_tables;
 }
 
-void Statement::bind(const int index, const double value) {
-  requireOpen();
-  handleBindResult(index, sqlite3_bind_double(m_handle, index, value));
+std::string QueryPlanError::getErrorMessage(const std::string& sql,
+    const std::vector<std::string>& tables) {
+  std::ostringstream stringStream;
+  stringStream << "Statement scans tables without an index:";
+  for (const std::string& table : tables) {
+    stringStream << " " << table;
+  }
+  stringStream << " in: " << sql;
+  return stringStream.str();
 }
 
-void Statement::bind(const std::string& name, const double value) {
-  bind(getParameterIndex(name), value);
+bool QueryPlanNode::isFullScan() const {
+  return operation == PlanOperation::kScan && !table.empty()
+      && index.empty();
 }
 
-void Statement::bind(const int index, const int value) {
-  requireOpen();
-  handleBindResult(index, sqlite3_bind_int(m_handle, index, value));
+namespace {
+
+void collectFullScans(const std::vector<QueryPlanNode>& nodes,
+                      std::vector<std::string>* tables) {
+  for (const QueryPlanNode& node : nodes) {
+    if (node.isFullScan()) {
+      tables->push_back(node.table);
+    }
+    collectFullScans(node.children, tables);
+  }
 }
 
-void Statement::bind(const std::string& name, const int value) {
-  bind(getParameterIndex(name), value);
+bool containsTempBTree(const std::vector<QueryPlanNode>& nodes) {
+  for (const QueryPlanNode& node : nodes) {
+    if (node.operation == PlanOperation::kTempBTree
+        || containsTempBTree(node.children)) {
+      return true;
+    }
+  }
+  return false;
 }
 
-void Statement::bind(const int index, const std::string& value) {
-  requireOpen();
-  handleBindResult(index, sqlite3_bind_text(m_handle, index, value.c_str(),
-      value.size(), NULL));
+void printPlan(const std::vector<QueryPlanNode>& nodes, const int depth,
+               std::ostringstream* stream) {
+  for (const QueryPlanNode& node : nodes) {
+    *stream << std::string(2 * depth, ' ') << node.detail << "\n";
+    printPlan(node.children, depth + 1, stream);
+  }
 }
 
-void Statement::bind(const std::string& name, const std::string& value) {
-  bind(getParameterIndex(name), value);
+bool startsWith(const std::string& text, const std::string& prefix) {
+  return text.compare(0, prefix.size(), prefix) == 0;
 }
 
-ResultSet Statement::execute() {
-  step();
-  return ResultSet(m_instancePointer.lock());
+QueryPlanNode parsePlanNode(const int id, const int parent,
+                            const char* detail) {
+  QueryPlanNode node;
+  node.id = id;
+  node.parent = parent;
+  node.detail = detail != NULL ? detail : "";
+  node.operation = PlanOperation::kOther;
+  node.coveringIndex = false;
+  node.automaticIndex = false;
+  node.primaryKey = false;
+
+  // the details have the format "SCAN t [USING [COVERING] INDEX i]" or
+  // "SEARCH t USING ..."; older versions write "SCAN TABLE t"
+  std::istringstream words(node.detail);
+  std::string word;
+  words >> word;
+  if (word == "SCAN" || word == "SEARCH") {
+    node.operation = word == "SCAN" ? PlanOperation::kScan
+        : PlanOperation::kSearch;
+    words >> word;
+    if (word == "TABLE") {
+      words >> word;
+    }
+    // SCAN CONSTANT ROW and SCAN (subquery-1) do not read a table
+    if (word != "CONSTANT" && !startsWith(word, "(")) {
+      node.table = word;
+    }
+    while (words >> word) {
+      if (word == "COVERING") {
+        node.coveringIndex = true;
+      } else if (word == "AUTOMATIC") {
+        node.automaticIndex = true;
+      } else if (word == "INDEX" && node.index.empty()) {
+        std::string index;
+        if (words >> index && !startsWith(index, "(")) {
+          node.index = index;
+        } else {
+          node.index = "(automatic)";
+        }
+      } else if (word == "PRIMARY" || word == "ROWID") {
+        node.primaryKey = true;
+        node.index = "(primary key)";
+      }
+    }
+  } else if (startsWith(node.detail, "USE TEMP B-TREE")) {
+    node.operation = PlanOperation::kTempBTree;
+  }
+  return node;
 }
 
-void Statement::requireCanRead() const {
-  if (!m_canRead) {
-    throw std::logic_error("Trying to read from statement without data");
+// splits SQL into identifiers and punctuation; literals and comments are
+// skipped and quoted identifiers are unquoted
+std::vector<std::string> tokenizeSql(const std::string& sql) {
+  std::vector<std::string> tokens;
+  std::size_t i = 0;
+  while (i < sql.size()) {
+    const char c = sql[i];
+    if (std::isspace(static_cast<unsigned char>(c))) {
+      i++;
+    } else if (sql.compare(i, 2, "--") == 0) {
+      i = sql.find('\n', i);
+    } else if (sql.compare(i, 2, "/*") == 0) {
+      i = sql.find("*/", i + 2);
+      i = i == std::string::npos ? i : i + 2;
+    } else if (c == '\'' || c == '"' || c == '`' || c == '[') {
+      const char end = c == '[' ? ']' : c;
+      std::string token;
+      for (i++; i < sql.size(); i++) {
+        if (sql[i] == end) {
+          if (end == ']' || i + 1 >= sql.size() || sql[i + 1] != end) {
+            break;
+          }
+          i++;
+        }
+        token += sql[i];
+      }
+      i++;
+      // string literals are replaced by a placeholder
+      tokens.push_back(c == '\'' ? "'" : token);
+    } else if (std::isalnum(static_cast<unsigned char>(c)) || c == '_'
+               || c == '$' || static_cast<unsigned char>(c) >= 0x80) {
+      const std::size_t start = i;
+      while (i < sql.size()
+             && (std::isalnum(static_cast<unsigned char>(sql[i]))
+                 || sql[i] == '_' || sql[i] == '$'
+                 || static_cast<unsigned char>(sql[i]) >= 0x80)) {
+        i++;
+      }
+      tokens.push_back(sql.substr(start, i - start));
+    } else {
+      tokens.push_back(std::string(1, c));
+      i++;
+    }
   }
+  return tokens;
 }
 
-void Statement::setInstancePointer(
-    const std::weak_ptr<Statement>& instancePointer) {
-  m_instancePointer = instancePointer;
+const std::string* findName(const std::vector<std::string>& names,
+                            const std::string& name) {
+  for (const std::string& candidate : names) {
+    if (sqlite3_stricmp(candidate.c_str(), name.c_str()) == 0) {
+      return &candidate;
+    }
+  }
+  return NULL;
 }
 
-bool Statement::step() {
-  requireOpen();
-  int result = sqlite3_step(m_handle);
-  if (result == SQLITE_ROW) {
-    m_canRead = true;
-  } else if (result == SQLITE_DONE) {
-    m_canRead = false;
-  } else {
-    throw DatabaseError(result);
+// returns the table that the given name from a query plan refers to or NULL
+// if it is not a table (e.g. a CTE or a subquery); aliases are resolved
+// using the "table [AS] alias" clauses of the statement
+const std::string* resolvePlanTable(const std::string& name,
+                                    const std::vector<std::string>& tokens,
+                                    const std::vector<std::string>& tables) {
+  for (std::size_t i = 1; i < tokens.size(); i++) {
+    if (sqlite3_stricmp(tokens[i].c_str(), name.c_str()) != 0) {
+      continue;
+    }
+    std::size_t table = i - 1;
+    if (sqlite3_stricmp(tokens[table].c_str(), "AS") == 0 && table > 0) {
+      table--;
+    }
+    const std::string* resolved = findName(tables, tokens[table]);
+    if (resolved != NULL) {
+      return resolved;
+    }
   }
-  return m_canRead;
+  return findName(tables, name);
 }
 
-void Statement::close() {
-  if (isOpen()) {
-    // errors that could occur during finalizing are ignored as they have
-    // already been handled!
-    sqlite3_finalize(m_handle);
-    setOpen(false);
+std::vector<QueryPlanNode> buildPlanTree(
+    const std::vector<QueryPlanNode>& nodes, const int parent) {
+  std::vector<QueryPlanNode> children;
+  for (const QueryPlanNode& node : nodes) {
+    if (node.parent == parent) {
+      children.push_back(node);
+      children.back().children = buildPlanTree(nodes, node.id);
+    }
   }
+  return children;
 }
 
-bool Statement::reset() {
-  requireOpen();
-  return sqlite3_reset(m_handle) == SQLITE_OK;
+}  // namespace
+
+std::vector<std::string> QueryPlan::fullScans() const {
+  std::vector<std::string> tables;
+  collectFullScans(nodes, &tables);
+  return tables;
 }
 
-int Statement::getParameterIndex(const std::string& name) const {
-  requireOpen();
-  int index = sqlite3_bind_parameter_index(m_handle, name.c_str());
-  if (index == 0) {
-    throw std::invalid_argument("No such parameter: " + name);
-  }
-  return index;
+bool QueryPlan::usesTempBTree() const {
+  return containsTempBTree(nodes);
 }
 
-void Statement::handleBindResult(const int index, const int result) const {
-  switch (result) {
-    case SQLITE_OK:
-      break;
-    case SQLITE_RANGE:
-      throw std::out_of_range("Bind index out of range: " + index);
-    case SQLITE_NOMEM:
-      throw std::runtime_error("No memory to bind parameter");
-    default:
-      throw DatabaseError(result);
-  }
+std::string QueryPlan::toString() const {
+  std::ostringstream stream;
+  printPlan(nodes, 0, &stream);
+  return stream.str();
 }
 
-Database::Database() : Openable(false, "Database") {
+TimeoutError::TimeoutError()
+    : DatabaseError(SQLITE_INTERRUPT, "Statement deadline exceeded") {
 }
 
-Database::Database(const std::string & file) : Database() {
-    open(file);
+CancelledError::CancelledError()
+    : DatabaseError(SQLITE_INTERRUPT, "Statement cancelled") {
 }
 
-Database::~Database() {
-  if (isOpen()) {
-    sqlite3_close(m_handle);
-    setOpen(false);
-  }
-  // m_handle is deleted by sqlite3_close
+CancellationToken::CancellationToken()
+    : m_cancelled(std::make_shared<std::atomic<bool>>(false)) {
 }
 
-void Database::close() {
-  if (isOpen()) {
-    int result = sqlite3_close(m_handle);
-    if (result == SQLITE_OK) {
-      setOpen(false);
-    } else {
-      throw sqlitepp::DatabaseError(result);
-    }
+void CancellationToken::cancel() {
+  m_cancelled->store(true);
+}
+
+bool CancellationToken::isCancelled() const {
+  return m_cancelled->load();
+}
+
+double QueryCacheStats::hitRate() const {
+  const std::uint64_t lookups = hits + misses;
+  if (lookups == 0) {
+    return 0;
   }
+  return static_cast<double>(hits) / lookups;
 }
 
-void Database::execute(const std::string& sql) {
-  requireOpen();
-  std::shared_ptr<Statement> statement = prepare(sql);
-  statement->step();
+namespace {
+
+// the number of virtual machine instructions between two deadline checks
+const int kProgressInterval = 1000;
+
+// the number of times a PrefetchCursor thread polls before it blocks
+const int kPrefetchSpins = 64;
+
+int textToInt(const std::string& text) {
+  return static_cast<int>(std::strtoll(text.c_str(), NULL, 10));
 }
 
-int Database::lastInsertRowId() const {
-  requireOpen();
-  return sqlite3_last_insert_rowid(m_handle);
+double textToDouble(const std::string& text) {
+  return std::strtod(text.c_str(), NULL);
 }
 
-void Database::open(const std::string& file) {
-  if (isOpen()) {
-    throw std::logic_error("sqlitepp::Database::open(std::string&): "
-                           "Database already open");
+std::string doubleToText(const double value) {
+  // mimics the "%!.15g" format SQLite3 uses to convert REAL to TEXT
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.15g", value);
+  std::string text(buffer);
+  if (text.find_first_of(".eEni") == std::string::npos) {
+    text += ".0";
   }
-  int result = sqlite3_open(file.c_str(), &m_handle);
+  return text;
+}
 
-  if (m_handle == NULL) {
-    throw std::runtime_error("sqlitepp::Database::open(std::string&): "
-                             "Can't allocate memory");
-  }
+// encodes a bound value for the cache key; doubles are stored bit by bit as
+// the expanded SQL only keeps 15 significant digits
+template<typename T>
+std::string encodeBinding(const char type, const T value) {
+  std::string binding(1 + sizeof(value), type);
+  std::memcpy(&binding[1], &value, sizeof(value));
+  return binding;
+}
 
-  if (result == SQLITE_OK) {
-    setOpen(true);
-  } else {
-    std::string errorMessage = sqlite3_errmsg(m_handle);
-    sqlite3_close(m_handle);
-    throw sqlitepp::DatabaseError(result, errorMessage);
-  }
+std::string encodeBinding(const std::string& value) {
+  return encodeBinding('t', static_cast<std::uint64_t>(value.size())) + value;
 }
 
-std::shared_ptr<Statement> Database::prepare(const std::string& sql) {
-  requireOpen();
-  sqlite3_stmt* statementHandle;
-  int result = sqlite3_prepare_v2(m_handle, sql.c_str(), sql.size(),
-                                  &statementHandle, NULL);
-  if (result != SQLITE_OK) {
-    throw DatabaseError(result, sqlite3_errmsg(m_handle));
+/// The tables accessed by a statement as reported by the authorizer.
+struct TableAccess {
+  TableAccess() : changesSchema(false) {
   }
-  if (statementHandle == NULL) {
-    throw std::runtime_error("Statement handle is NULL");
+
+  std::vector<std::string> readTables;
+  std::vector<std::string> writeTables;
+  bool changesSchema;
+  std::string savepointOperation;
+  std::string savepointName;
+};
+
+// the parameters of the 64-bit FNV-1a hash function
+const std::uint64_t kFnvOffsetBasis = 14695981039346656037ULL;
+const std::uint64_t kFnvPrime = 1099511628211ULL;
+
+std::uint64_t hashBytes(const unsigned char* data, const std::size_t size) {
+  std::uint64_t hash = kFnvOffsetBasis;
+  for (std::size_t i = 0; i < size; i++) {
+    hash ^= data[i];
+    hash *= kFnvPrime;
   }
-  auto statement = std::shared_ptr<Statement>(new Statement(statementHandle));
-  statement->setInstancePointer(std::weak_ptr<Statement>(statement));
-  return statement;
+  return hash;
 }
 
-ResultSet::ResultSet(const std::shared_ptr<Statement> statement)
-    : m_statement(statement) {
+std::size_t shardIndex(const std::string& key, const std::size_t shards) {
+  return hashBytes(reinterpret_cast<const unsigned char*>(key.data()),
+                   key.size()) % shards;
 }
 
-bool ResultSet::canRead() const {
-  return m_statement->m_canRead;
+std::size_t shardIndex(const sqlite3_int64 key, const std::size_t shards) {
+  unsigned char bytes[sizeof(key)];
+  const std::uint64_t value = static_cast<std::uint64_t>(key);
+  for (std::size_t i = 0; i < sizeof(bytes); i++) {
+    bytes[i] = static_cast<unsigned char>(value >> (8 * i));
+  }
+  return hashBytes(bytes, sizeof(bytes)) % shards;
 }
 
-int ResultSet::columnCount() const {
-  m_statement->requireOpen();
-  m_statement->requireCanRead();
-  return sqlite3_data_count(m_statement->m_handle);
+// compares two values using the SQLite3 sort order for NULL, numbers and
+// strings
+int compareColumns(const ResultSet& first, const ResultSet& second,
+                   const int column) {
+  const auto typeOrder = [](const int type) {
+    switch (type) {
+      case SQLITE_NULL:
+        return 0;
+      case SQLITE_INTEGER:
+      case SQLITE_FLOAT:
+        return 1;
+      case SQLITE_TEXT:
+        return 2;
+      default:
+        return 3;
+    }
+  };
+  const int firstOrder = typeOrder(first.columnType(column));
+  const int secondOrder = typeOrder(second.columnType(column));
+  if (firstOrder != secondOrder) {
+    return firstOrder < secondOrder ? -1 : 1;
+  }
+  if (firstOrder == 0) {
+    return 0;
+  }
+  if (firstOrder == 1) {
+    const double firstValue = first.readDouble(column);
+    const double secondValue = second.readDouble(column);
+    return firstValue < secondValue ? -1 : (secondValue < firstValue ? 1 : 0);
+  }
+  return first.readString(column).compare(second.readString(column));
 }
 
-double ResultSet::readDouble(const int column) const {
-  m_statement->requireOpen();
-  m_statement->requireCanRead();
-  return sqlite3_column_double(m_statement->m_handle, column);
+void removeDuplicates(std::vector<std::string>* tables) {
+  std::sort(tables->begin(), tables->end());
+  tables->erase(std::unique(tables->begin(), tables->end()), tables->end());
 }
 
-int ResultSet::readInt(const int column) const {
-  m_statement->requireOpen();
-  m_statement->requireCanRead();
-  return sqlite3_column_int(m_statement->m_handle, column);
+int authorize(void* data, int action, const char* arg1, const char* arg2,
+              const char* arg3, const char* arg4) {
+  TableAccess* access = static_cast<TableAccess*>(data);
+  switch (action) {
+    case SQLITE_READ:
+      if (arg1 != NULL) {
+        access->readTables.push_back(arg1);
+      }
+      break;
+    case SQLITE_INSERT:
+    case SQLITE_UPDATE:
+    case SQLITE_DELETE:
+      if (arg1 != NULL) {
+        access->writeTables.push_back(arg1);
+      }
+      break;
+    case SQLITE_SAVEPOINT:
+      // ROLLBACK TO neither calls the rollback hook nor the update hook, so
+      // the connection tracks the savepoints itself
+      if (arg1 != NULL && arg2 != NULL) {
+        access->savepointOperation = arg1;
+        access->savepointName = arg2;
+      }
+      break;
+    case SQLITE_PRAGMA:
+    case SQLITE_ATTACH:
+    case SQLITE_DETACH:
+    case SQLITE_FUNCTION:
+    case SQLITE_SELECT:
+    case SQLITE_TRANSACTION:
+    case SQLITE_RECURSIVE:
+    case SQLITE_ANALYZE:
+      break;
+    default:
+      // all other actions create, alter or drop schema objects
+      access->changesSchema = true;
+      break;
+  }
+  return SQLITE_OK;
 }
 
-std::string ResultSet::readString(const int column) const {
-  m_statement->requireOpen();
-  m_statement->requireCanRead();
-  return std::string((const char*) sqlite3_column_text(m_statement->m_handle,
-                                                       column));
+}  // namespace
+
+namespace detail {
+
+/// A decoded value of a result column.  The conversions mimic the ones of
+/// SQLite3.
+struct ValueView {
+  ValueView() : type(SQLITE_NULL), integer(0), real(0), text(NULL), size(0) {
+  }
+
+  double toDouble() const {
+    switch (type) {
+      case SQLITE_INTEGER:
+        return static_cast<double>(integer);
+      case SQLITE_FLOAT:
+        return real;
+      case SQLITE_TEXT:
+      case SQLITE_BLOB:
+        return textToDouble(std::string(text, size));
+      default:
+        return 0;
+    }
+  }
+
+  int toInt() const {
+    switch (type) {
+      case SQLITE_INTEGER:
+        return static_cast<int>(integer);
+      case SQLITE_FLOAT:
+        return static_cast<int>(real);
+      case SQLITE_TEXT:
+      case SQLITE_BLOB:
+        return textToInt(std::string(text, size));
+      default:
+        return 0;
+    }
+  }
+
+  std::string toString() const {
+    switch (type) {
+      case SQLITE_INTEGER:
+        return std::to_string(integer);
+      case SQLITE_FLOAT:
+        return doubleToText(real);
+      case SQLITE_TEXT:
+      case SQLITE_BLOB:
+        return std::string(text, size);
+      default:
+        return std::string();
+    }
+  }
+
+  int type;
+  sqlite3_int64 integer;
+  double real;
+  const char* text;
+  std::size_t size;
+};
+
+/// Decodes a column of the current row of the given statement and returns
+/// its type.  The bytes of TEXT and BLOB values are passed to assignText.
+template<typename AssignText>
+int decodeColumn(sqlite3_stmt* handle, const int column,
+                 sqlite3_int64* integer, double* real,
+                 const AssignText& assignText) {
+  const int type = sqlite3_column_type(handle, column);
+  switch (type) {
+    case SQLITE_INTEGER:
+      *integer = sqlite3_column_int64(handle, column);
+      break;
+    case SQLITE_FLOAT:
+      *real = sqlite3_column_double(handle, column);
+      break;
+    case SQLITE_TEXT:
+    case SQLITE_BLOB: {
+      const void* data = type == SQLITE_TEXT
+          ? static_cast<const void*>(sqlite3_column_text(handle, column))
+          : sqlite3_column_blob(handle, column);
+      if (data == NULL) {
+        assignText("", 0);
+      } else {
+        assignText(static_cast<const char*>(data),
+                   sqlite3_column_bytes(handle, column));
+      }
+      break;
+    }
+    default:
+      break;
+  }
+  return type;
 }
 
-bool ResultSet::next() {
-  return m_statement->step();
+/// Decoded rows of a query result.  The cells are stored row by row; the
+/// values of TEXT and BLOB cells are stored in one shared buffer.
+class CachedResult {
+ public:
+  struct Cell {
+    int type;
+    union {
+      sqlite3_int64 integer;
+      double real;
+      struct {
+        std::uint32_t offset;
+        std::uint32_t size;
+      } text;
+    };
+  };
+
+  explicit CachedResult(const int columnCount)
+      : m_columnCount(columnCount), m_rowCount(0) {
+  }
+
+  /// Appends the current row of the statement unless the result would use
+  /// more than limit bytes or its text would not fit the 32-bit offsets.
+  /// Returns false and leaves the result unchanged if the row is rejected.
+  bool append(sqlite3_stmt* handle, const std::size_t limit) {
+    const std::size_t cellCount = m_cells.size();
+    const std::size_t textSize = m_text.size();
+    bool fits = true;
+    for (int i = 0; i < m_columnCount; i++) {
+      Cell cell;
+      cell.type = decodeColumn(handle, i, &cell.integer, &cell.real,
+          [this, &cell, &fits](const char* data, const std::size_t size) {
+            if (size > std::numeric_limits<std::uint32_t>::max()
+                - m_text.size()) {
+              fits = false;
+              return;
+            }
+            cell.text.offset = static_cast<std::uint32_t>(m_text.size());
+            cell.text.size = static_cast<std::uint32_t>(size);
+            m_text.append(data, size);
+          });
+      m_cells.push_back(cell);
+    }
+    if (!fits || sizeof(*this) + m_cells.size() * sizeof(Cell)
+        + m_text.size() > limit) {
+      m_cells.resize(cellCount);
+      m_text.resize(textSize);
+      return false;
+    }
+    m_rowCount++;
+    return true;
+  }
+
+  const Cell* cell(const std::size_t row, const int column) const {
+    if (column < 0 || column >= m_columnCount || row >= m_rowCount) {
+      return NULL;
+    }
+    return &m_cells[row * m_columnCount + column];
+  }
+
+  int columnCount() const {
+    return m_columnCount;
+  }
+
+  std::size_t memoryUsage() const {
+    return sizeof(*this) + m_cells.capacity() * sizeof(Cell)
+        + m_text.capacity();
+  }
+
+  std::size_t rowCount() const {
+    return m_rowCount;
+  }
+
+  void shrink() {
+    m_cells.shrink_to_fit();
+    m_text.shrink_to_fit();
+  }
+
+  ValueView view(const std::size_t row, const int column) const {
+    ValueView view;
+    const Cell* cell = this->cell(row, column);
+    if (cell == NULL) {
+      return view;
+    }
+    view.type = cell->type;
+    switch (cell->type) {
+      case SQLITE_INTEGER:
+        view.integer = cell->integer;
+        break;
+      case SQLITE_FLOAT:
+        view.real = cell->real;
+        break;
+      case SQLITE_TEXT:
+      case SQLITE_BLOB:
+        view.text = m_text.data() + cell->text.offset;
+        view.size = cell->text.size;
+        break;
+      default:
+        break;
+    }
+    return view;
+  }
+
+ private:
+  const int m_columnCount;
+  std::size_t m_rowCount;
+  std::vector<Cell> m_cells;
+  std::string m_text;
+};
+
+/// The result cache of a connection.  Entries are indexed by their key, by
+/// the tables they read from and by their last use.
+class QueryCache {
+ public:
+  QueryCache(sqlite3* handle, const std::size_t capacity,
+             const bool immutable)
+      : m_dataVersionStatement(NULL), m_dataVersion(-1),
+        m_capacity(capacity), m_memoryUsage(0), m_hits(0), m_misses(0),
+        m_invalidations(0), m_evictions(0) {
+    if (immutable) {
+      // immutable databases cannot be changed by other connections
+      return;
+    }
+    const int result = sqlite3_prepare_v2(handle, "PRAGMA data_version;", -1,
+                                          &m_dataVersionStatement, NULL);
+    if (result != SQLITE_OK) {
+      throw DatabaseError(result, sqlite3_errmsg(handle));
+    }
+  }
+
+  ~QueryCache() {
+    sqlite3_finalize(m_dataVersionStatement);
+  }
+
+  void clear() {
+    m_invalidations += m_entries.size();
+    m_entries.clear();
+    m_tables.clear();
+    m_lru.clear();
+    m_memoryUsage = 0;
+  }
+
+  void insert(const std::string& key,
+              const std::shared_ptr<const CachedResult>& result,
+              const std::vector<std::string>& tables) {
+    const std::size_t size = result->memoryUsage() + 2 * key.size();
+    if (size > m_capacity || m_entries.count(key) > 0) {
+      return;
+    }
+    while (m_memoryUsage + size > m_capacity) {
+      erase(m_entries.find(*m_lru.back()));
+      m_evictions++;
+    }
+    auto inserted = m_entries.emplace(key, Entry());
+    Entry& entry = inserted.first->second;
+    const std::string* keyPointer = &inserted.first->first;
+    entry.result = result;
+    entry.tables = tables;
+    entry.size = size;
+    entry.lruPosition = m_lru.insert(m_lru.begin(), keyPointer);
+    for (const std::string& table : tables) {
+      m_tables[table].insert(keyPointer);
+    }
+    m_memoryUsage += size;
+  }
+
+  void invalidate(const std::string& table) {
+    auto tableIterator = m_tables.find(table);
+    if (tableIterator == m_tables.end()) {
+      return;
+    }
+    while (tableIterator != m_tables.end()) {
+      // erasing the last entry of a table removes the table from the index
+      erase(m_entries.find(**tableIterator->second.begin()));
+      m_invalidations++;
+      tableIterator = m_tables.find(table);
+    }
+  }
+
+  std::shared_ptr<const CachedResult> lookup(const std::string& key) {
+    checkDataVersion();
+    auto iterator = m_entries.find(key);
+    if (iterator == m_entries.end()) {
+      m_misses++;
+      return std::shared_ptr<const CachedResult>();
+    }
+    m_hits++;
+    m_lru.splice(m_lru.begin(), m_lru, iterator->second.lruPosition);
+    return iterator->second.result;
+  }
+
+  void setCapacity(const std::size_t capacity) {
+    m_capacity = capacity;
+    while (m_memoryUsage > m_capacity) {
+      erase(m_entries.find(*m_lru.back()));
+      m_evictions++;
+    }
+  }
+
+  std::size_t capacity() const {
+    return m_capacity;
+  }
+
+  bool ownsStatement(sqlite3_stmt* statement) const {
+    return statement == m_dataVersionStatement;
+  }
+
+  QueryCacheStats stats() const {
+    QueryCacheStats stats;
+    stats.hits = m_hits;
+    stats.misses = m_misses;
+    stats.invalidations = m_invalidations;
+    stats.evictions = m_evictions;
+    stats.entries = m_entries.size();
+    stats.memoryUsage = m_memoryUsage;
+    stats.capacity = m_capacity;
+    return stats;
+  }
+
+ private:
+  struct Entry {
+    std::shared_ptr<const CachedResult> result;
+    std::vector<std::string> tables;
+    std::size_t size;
+    std::list<const std::string*>::iterator lruPosition;
+  };
+
+  typedef std::unordered_map<std::string, Entry> EntryMap;
+
+  void checkDataVersion() {
+    if (m_dataVersionStatement == NULL) {
+      return;
+    }
+    // PRAGMA data_version only changes if another connection commits
+    sqlite3_int64 dataVersion = -1;
+    if (sqlite3_step(m_dataVersionStatement) == SQLITE_ROW) {
+      dataVersion = sqlite3_column_int64(m_dataVersionStatement, 0);
+    }
+    sqlite3_reset(m_dataVersionStatement);
+    if (dataVersion != m_dataVersion || dataVersion == -1) {
+      clear();
+      m_dataVersion = dataVersion;
+    }
+  }
+
+  void erase(EntryMap::iterator iterator) {
+    const std::string* keyPointer = &iterator->first;
+    Entry& entry = iterator->second;
+    for (const std::string& table : entry.tables) {
+      auto tableIterator = m_tables.find(table);
+      if (tableIterator == m_tables.end()) {
+        continue;
+      }
+      tableIterator->second.erase(keyPointer);
+      if (tableIterator->second.empty()) {
+        m_tables.erase(tableIterator);
+      }
+    }
+    m_lru.erase(entry.lruPosition);
+    m_memoryUsage -= entry.size;
+    m_entries.erase(iterator);
+  }
+
+  sqlite3_stmt* m_dataVersionStatement;
+  sqlite3_int64 m_dataVersion;
+  std::size_t m_capacity;
+  std::size_t m_memoryUsage;
+  std::uint64_t m_hits;
+  std::uint64_t m_misses;
+  std::uint64_t m_invalidations;
+  std::uint64_t m_evictions;
+  EntryMap m_entries;
+  std::unordered_map<std::string, std::unordered_set<const std::string*>>
+      m_tables;
+  std::list<const std::string*> m_lru;
+};
+
+/// The state of a CheckpointManager that is shared with the WAL hooks of the
+/// attached connections.
+class CheckpointState {
+ public:
+  explicit CheckpointState(const int frameThreshold)
+      : frameThreshold(frameThreshold), walFrames(0), pageSize(0),
+        lastCommit(0), stopped(false), stats() {
+  }
+
+  static int walHook(void* data, sqlite3* handle, const char* database,
+                     int frames) {
+    CheckpointState* state = static_cast<CheckpointState*>(data);
+    if (std::strcmp(database, "main") != 0) {
+      return SQLITE_OK;
+    }
+    state->walFrames.store(frames, std::memory_order_relaxed);
+    state->lastCommit.store(now(), std::memory_order_relaxed);
+    if (frames >= state->frameThreshold) {
+      state->wakeUp.notify_one();
+    }
+    return SQLITE_OK;
+  }
+
+  static std::int64_t now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  void record(const int result, const bool truncate,
+              const std::chrono::microseconds duration) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (result == SQLITE_BUSY) {
+      stats.busyCheckpoints++;
+    } else if (result != SQLITE_OK) {
+      stats.failedCheckpoints++;
+    } else if (truncate) {
+      stats.truncateCheckpoints++;
+    } else {
+      stats.passiveCheckpoints++;
+    }
+    stats.lastDuration = duration;
+    stats.maxDuration = std::max(stats.maxDuration, duration);
+    stats.totalDuration += duration;
+  }
+
+  // restores the automatic checkpoints of the attached connections
+  void detachAll() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto& connection : connections) {
+      sqlite3_wal_autocheckpoint(connection.first, connection.second);
+    }
+    connections.clear();
+  }
+
+  void detach(sqlite3* handle) {
+    std::lock_guard<std::mutex> lock(mutex);
+    connections.erase(std::remove_if(connections.begin(), connections.end(),
+        [handle](const std::pair<sqlite3*, int>& connection) {
+          return connection.first == handle;
+        }), connections.end());
+  }
+
+  const int frameThreshold;
+  std::atomic<int> walFrames;
+  std::atomic<int> pageSize;
+  std::atomic<std::int64_t> lastCommit;
+  std::mutex mutex;
+  std::condition_variable wakeUp;
+  bool stopped;
+  CheckpointStats stats;
+  // the attached connections and their previous automatic checkpoint size;
+  // connections detach themselves when they are released
+  std::vector<std::pair<sqlite3*, int>> connections;
+};
+
+/// The state of an open database connection that is shared between the
+/// Database and its statements.  It dispatches the SQLite3 hooks.
+class Connection {
+ public:
+  Connection(sqlite3* handle, const bool immutable)
+      : m_handle(handle), m_immutable(immutable), m_committed(false),
+        m_nextSubscription(1) {
+  }
+
+  int addSubscriber(const ChangeCallback& callback,
+                    const std::shared_ptr<ChangeQueue>& queue) {
+    Subscriber subscriber;
+    subscriber.id = m_nextSubscription++;
+    subscriber.callback = callback;
+    subscriber.queue = queue;
+    m_subscribers.push_back(subscriber);
+    updateHooks();
+    return subscriber.id;
+  }
+
+  QueryCache* cache() const {
+    return m_cache.get();
+  }
+
+  void disableCache() {
+    m_cache.reset();
+    updateHooks();
+  }
+
+  void enableCache(const std::size_t capacity) {
+    if (m_cache) {
+      m_cache->setCapacity(capacity);
+    } else {
+      m_cache.reset(new QueryCache(m_handle, capacity, m_immutable));
+      updateHooks();
+    }
+  }
+
+  void handleWrite(const bool tracked, const bool changesSchema,
+                   const std::vector<std::string>& writeTables) {
+    if (!m_cache) {
+      return;
+    }
+    // the update hook misses the truncate optimization and WITHOUT ROWID
+    // tables, so the tables reported by the authorizer are invalidated too
+    if (!tracked || changesSchema) {
+      m_cache->clear();
+    } else {
+      for (const std::string& table : writeTables) {
+        m_cache->invalidate(table);
+      }
+    }
+  }
+
+  void handleSavepoint(const std::string& operation,
+                       const std::string& name) {
+    if (operation == "BEGIN") {
+      m_savepoints.emplace_back(name, m_pending.size());
+      return;
+    }
+    if (operation == "ROLLBACK" && m_cache) {
+      m_cache->clear();
+    }
+    // savepoint names are case-insensitive and refer to the innermost match
+    auto savepoint = m_savepoints.rbegin();
+    while (savepoint != m_savepoints.rend()
+           && sqlite3_stricmp(savepoint->first.c_str(), name.c_str()) != 0) {
+      ++savepoint;
+    }
+    if (savepoint == m_savepoints.rend()) {
+      return;
+    }
+    if (operation == "ROLLBACK") {
+      // ROLLBACK TO keeps the savepoint, but drops the newer ones
+      m_pending.resize(std::min(m_pending.size(), savepoint->second));
+      m_savepoints.erase(savepoint.base(), m_savepoints.end());
+    } else if (operation == "RELEASE") {
+      m_savepoints.erase(std::prev(savepoint.base()), m_savepoints.end());
+    }
+  }
+
+  std::size_t pendingChanges() const {
+    return m_pending.size();
+  }
+
+  void handleStep(const int result, const std::size_t pendingBefore) {
+    // sqlite3_changes is reset to zero if SQLite3 rolled back the failed
+    // statement; with ON CONFLICT FAIL, its changes are kept
+    if (result != SQLITE_ROW && result != SQLITE_DONE
+        && m_pending.size() > pendingBefore
+        && sqlite3_changes(m_handle) == 0) {
+      m_pending.resize(pendingBefore);
+    }
+    if (sqlite3_get_autocommit(m_handle)) {
+      m_savepoints.clear();
+      if (m_committed) {
+        publishChanges();
+      }
+    }
+  }
+
+  bool tracksStatements() const {
+    return m_cache || !m_subscribers.empty();
+  }
+
+  // checks whether statements other than the ones owned by the connection
+  // are open, which makes sqlite3_close fail with SQLITE_BUSY
+  bool hasOpenStatements() const {
+    for (sqlite3_stmt* statement = sqlite3_next_stmt(m_handle, NULL);
+         statement != NULL;
+         statement = sqlite3_next_stmt(m_handle, statement)) {
+      if (!m_cache || !m_cache->ownsStatement(statement)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void release() {
+    m_cache.reset();
+    m_subscribers.clear();
+    m_pending.clear();
+    m_savepoints.clear();
+    updateHooks();
+    if (m_walObserver) {
+      m_walObserver->detach(m_handle);
+      sqlite3_wal_hook(m_handle, NULL, NULL);
+      m_walObserver.reset();
+    }
+  }
+
+  void setWalObserver(const std::shared_ptr<CheckpointState>& observer) {
+    m_walObserver = observer;
+  }
+
+  void removeSubscriber(const int id) {
+    for (auto iterator = m_subscribers.begin();
+         iterator != m_subscribers.end(); ++iterator) {
+      if (iterator->id == id) {
+        m_subscribers.erase(iterator);
+        break;
+      }
+    }
+    updateHooks();
+  }
+
+ private:
+  struct Subscriber {
+    int id;
+    ChangeCallback callback;
+    std::shared_ptr<ChangeQueue> queue;
+  };
+
+  static int commitHook(void* data) {
+    // the commit may still fail, so the changes are published once the
+    // connection is back in autocommit mode
+    static_cast<Connection*>(data)->m_committed = true;
+    return 0;
+  }
+
+  static void rollbackHook(void* data) {
+    Connection* connection = static_cast<Connection*>(data);
+    if (connection->m_cache) {
+      connection->m_cache->clear();
+    }
+    connection->m_pending.clear();
+    connection->m_savepoints.clear();
+    connection->m_committed = false;
+  }
+
+  static void updateHook(void* data, int operation, const char* database,
+                         const char* table, sqlite3_int64 rowId) {
+    Connection* connection = static_cast<Connection*>(data);
+    if (connection->m_cache) {
+      connection->m_cache->invalidate(table);
+    }
+    if (!connection->m_subscribers.empty()) {
+      Change change;
+      switch (operation) {
+        case SQLITE_INSERT:
+          change.operation = ChangeOperation::kInsert;
+          break;
+        case SQLITE_UPDATE:
+          change.operation = ChangeOperation::kUpdate;
+          break;
+        default:
+          change.operation = ChangeOperation::kDelete;
+          break;
+      }
+      change.table = table;
+      change.rowId = rowId;
+      connection->m_pending.push_back(std::move(change));
+    }
+  }
+
+  void publishChanges() {
+    m_committed = false;
+    if (m_pending.empty()) {
+      return;
+    }
+    auto batch = std::make_shared<ChangeBatch>();
+    batch->swap(m_pending);
+    // copy the subscribers as callbacks may unsubscribe
+    const std::vector<Subscriber> subscribers = m_subscribers;
+    for (const Subscriber& subscriber : subscribers) {
+      if (subscriber.queue) {
+        subscriber.queue->push(batch);
+      } else {
+        subscriber.callback(*batch);
+      }
+    }
+  }
+
+  void updateHooks() {
+    const bool subscribed = !m_subscribers.empty();
+    const bool enabled = m_cache || subscribed;
+    sqlite3_update_hook(m_handle, enabled ? &updateHook : NULL, this);
+    sqlite3_rollback_hook(m_handle, enabled ? &rollbackHook : NULL, this);
+    sqlite3_commit_hook(m_handle, subscribed ? &commitHook : NULL, this);
+  }
+
+  sqlite3* m_handle;
+  const bool m_immutable;
+  std::unique_ptr<QueryCache> m_cache;
+  std::vector<Subscriber> m_subscribers;
+  ChangeBatch m_pending;
+  // the open savepoints and the number of pending changes when they began
+  std::vector<std::pair<std::string, std::size_t>> m_savepoints;
+  bool m_committed;
+  int m_nextSubscription;
+  std::shared_ptr<CheckpointState> m_walObserver;
+};
+
+}  // namespace detail
+
+ChangeQueue::ChangeQueue(const std::size_t capacity)
+    : m_slots(capacity + 1), m_head(0), m_tail(0), m_droppedBatches(0) {
+  if (capacity == 0) {
+    throw std::invalid_argument("ChangeQueue capacity must not be zero");
+  }
+}
+
+std::size_t ChangeQueue::capacity() const {
+  return m_slots.size() - 1;
+}
+
+std::uint64_t ChangeQueue::droppedBatches() const {
+  return m_droppedBatches.load(std::memory_order_relaxed);
+}
+
+bool ChangeQueue::pop(std::shared_ptr<const ChangeBatch>* batch) {
+  const std::size_t head = m_head.load(std::memory_order_relaxed);
+  if (head == m_tail.load(std::memory_order_acquire)) {
+    return false;
+  }
+  *batch = std::move(m_slots[head]);
+  m_head.store((head + 1) % m_slots.size(), std::memory_order_release);
+  return true;
+}
+
+bool ChangeQueue::push(const std::shared_ptr<const ChangeBatch>& batch) {
+  const std::size_t tail = m_tail.load(std::memory_order_relaxed);
+  const std::size_t next = (tail + 1) % m_slots.size();
+  if (next == m_head.load(std::memory_order_acquire)) {
+    m_droppedBatches.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  m_slots[tail] = batch;
+  m_tail.store(next, std::memory_order_release);
+  return true;
+}
+
+Statement::Statement(sqlite3_stmt* handle,
+                     const std::shared_ptr<detail::Connection>& connection)
+    : Openable(true, "Statement"), m_handle(handle), m_canRead(false),
+      m_connection(connection), m_readOnly(sqlite3_stmt_readonly(handle) != 0),
+      m_tracked(false), m_changesSchema(false), m_hasDeadline(false) {
+}
+
+Statement::~Statement() {
+  if (isOpen()) {
+    // errors that could occur during finalizing are ignored as they have
+    // already been handled!
+    sqlite3_finalize(m_handle);
+    setOpen(false);
+  }
+}
+
+void Statement::bind(const int index, const double value) {
+  requireOpenIfChecked();
+  handleBindResult(index, sqlite3_bind_double(m_handle, index, value));
+  recordBinding(index, encodeBinding('r', value));
+}
+
+void Statement::bind(const std::string& name, const double value) {
+  bind(getParameterIndex(name), value);
+}
+
+void Statement::bind(const int index, const int value) {
+  requireOpenIfChecked();
+  handleBindResult(index, sqlite3_bind_int(m_handle, index, value));
+  recordBinding(index, encodeBinding('i', value));
+}
+
+void Statement::bind(const std::string& name, const int value) {
+  bind(getParameterIndex(name), value);
+}
+
+void Statement::bind(const int index, const std::string& value) {
+  requireOpenIfChecked();
+  handleBindResult(index, sqlite3_bind_text(m_handle, index, value.c_str(),
+      value.size(), SQLITE_TRANSIENT));
+  recordBinding(index, encodeBinding(value));
+}
+
+void Statement::bind(const std::string& name, const std::string& value) {
+  bind(getParameterIndex(name), value);
+}
+
+ResultSet Statement::execute() {
+  m_hasDeadline = false;
+  m_token.reset();
+  return executeLimited();
+}
+
+ResultSet Statement::execute(const Deadline& deadline) {
+  m_hasDeadline = true;
+  m_deadline = deadline;
+  m_token.reset();
+  return executeLimited();
+}
+
+ResultSet Statement::execute(const CancellationToken& token) {
+  m_hasDeadline = false;
+  m_token.reset(new CancellationToken(token));
+  return executeLimited();
+}
+
+ResultSet Statement::execute(const Deadline& deadline,
+                             const CancellationToken& token) {
+  m_hasDeadline = true;
+  m_deadline = deadline;
+  m_token.reset(new CancellationToken(token));
+  return executeLimited();
+}
+
+ResultSet Statement::executeLimited() {
+  requireOpen();
+  if (m_tracked && m_readOnly && !m_readTables.empty()
+      && m_connection->cache() != NULL) {
+    return executeCached();
+  }
+  step();
+  return ResultSet(m_instancePointer.lock());
+}
+
+ResultSet Statement::executeCached() {
+  requireOpen();
+  // the key consists of the SQL text and the exact bound values; unbound
+  // parameters are NULL and encoded as empty strings
+  std::string key(sqlite3_sql(m_handle));
+  for (const std::string& binding : m_bindings) {
+    key += '\0';
+    key += binding;
+  }
+
+  detail::QueryCache* cache = m_connection->cache();
+  std::shared_ptr<const detail::CachedResult> result = cache->lookup(key);
+  if (!result) {
+    // QueryCache::insert also accounts for the key
+    const std::size_t capacity = cache->capacity();
+    const std::size_t limit = capacity > 2 * key.size()
+        ? capacity - 2 * key.size() : 0;
+    auto fetched = std::make_shared<detail::CachedResult>(
+        sqlite3_column_count(m_handle));
+    while (step()) {
+      if (!fetched->append(m_handle, limit)) {
+        // the result does not fit into the cache, so the rows fetched so far
+        // are returned and the statement continues with the rejected row
+        if (fetched->rowCount() == 0) {
+          return ResultSet(m_instancePointer.lock());
+        }
+        return ResultSet(m_instancePointer.lock(), fetched, true);
+      }
+    }
+    fetched->shrink();
+    cache->insert(key, fetched, m_readTables);
+    result = fetched;
+  }
+  m_canRead = false;
+  return ResultSet(m_instancePointer.lock(), result, false);
+}
+
+void Statement::recordBinding(const int index, std::string binding) {
+  if (!m_tracked || !m_readOnly) {
+    return;
+  }
+  if (m_bindings.empty()) {
+    m_bindings.resize(sqlite3_bind_parameter_count(m_handle));
+  }
+  m_bindings[index - 1] = std::move(binding);
+}
+
+void Statement::throwCannotRead() const {
+  throw std::logic_error("Trying to read from statement without data");
+}
+
+void Statement::setInstancePointer(
+    const std::weak_ptr<Statement>& instancePointer) {
+  m_instancePointer = instancePointer;
+}
+
+bool Statement::step() {
+  requireOpenIfChecked();
+  const std::size_t pendingChanges = m_connection->pendingChanges();
+  const bool limited = m_hasDeadline || m_token;
+  if (limited) {
+    checkLimits();
+    sqlite3_progress_handler(sqlite3_db_handle(m_handle), kProgressInterval,
+                             &progressHandler, this);
+  }
+  int result = sqlite3_step(m_handle);
+  if (limited) {
+    sqlite3_progress_handler(sqlite3_db_handle(m_handle), 0, NULL, NULL);
+  }
+  if (!m_readOnly) {
+    m_connection->handleWrite(m_tracked, m_changesSchema, m_writeTables);
+  }
+  if (!m_savepointOperation.empty() && result == SQLITE_DONE) {
+    m_connection->handleSavepoint(m_savepointOperation, m_savepointName);
+  }
+  m_connection->handleStep(result, pendingChanges);
+  if (result == SQLITE_ROW) {
+    m_canRead = true;
+  } else if (result == SQLITE_DONE) {
+    m_canRead = false;
+  } else {
+    m_canRead = false;
+    if (result == SQLITE_INTERRUPT && limited) {
+      checkLimits();
+    }
+    throw DatabaseError(result);
+  }
+  return m_canRead;
+}
+
+void Statement::checkLimits() {
+  if (m_token && m_token->isCancelled()) {
+    m_canRead = false;
+    throw CancelledError();
+  }
+  if (m_hasDeadline && std::chrono::steady_clock::now() >= m_deadline) {
+    m_canRead = false;
+    throw TimeoutError();
+  }
+}
+
+int Statement::progressHandler(void* data) {
+  const Statement* statement = static_cast<const Statement*>(data);
+  if (statement->m_token && statement->m_token->isCancelled()) {
+    return 1;
+  }
+  if (statement->m_hasDeadline
+      && std::chrono::steady_clock::now() >= statement->m_deadline) {
+    return 1;
+  }
+  return 0;
+}
+
+void Statement::close() {
+  if (isOpen()) {
+    // errors that could occur during finalizing are ignored as they have
+    // already been handled!
+    sqlite3_finalize(m_handle);
+    setOpen(false);
+  }
+}
+
+bool Statement::reset() {
+  requireOpen();
+  const bool success = sqlite3_reset(m_handle) == SQLITE_OK;
+  // a write statement that was not stepped to completion commits on reset
+  m_connection->handleStep(SQLITE_DONE, 0);
+  return success;
+}
+
+const std::vector<std::string>& Statement::planWarnings() const {
+  return m_planWarnings;
+}
+
+int Statement::getParameterIndex(const std::string& name) const {
+  requireOpen();
+  int index = sqlite3_bind_parameter_index(m_handle, name.c_str());
+  if (index == 0) {
+    throw std::invalid_argument("No such parameter: " + name);
+  }
+  return index;
+}
+
+void Statement::handleBindResult(const int index, const int result) const {
+  switch (result) {
+    case SQLITE_OK:
+      break;
+    case SQLITE_RANGE:
+      throw std::out_of_range("Bind index out of range: " + index);
+    case SQLITE_NOMEM:
+      throw std::runtime_error("No memory to bind parameter");
+    default:
+      throw DatabaseError(result);
+  }
+}
+
+Database::Database()
+    : Openable(false, "Database"), m_planCheckAction(PlanCheckAction::kIgnore),
+      m_planCheckMinimumRows(0) {
+}
+
+Database::Database(const std::string & file) : Database() {
+    open(file);
+}
+
+Database::~Database() {
+  if (isOpen()) {
+    m_connection->release();
+    sqlite3_close(m_handle);
+    setOpen(false);
+  }
+  // m_handle is deleted by sqlite3_close
+}
+
+void Database::clearQueryCache() {
+  if (isOpen() && m_connection->cache() != NULL) {
+    m_connection->cache()->clear();
+  }
+}
+
+void Database::close() {
+  if (isOpen()) {
+    // the connection must stay intact if it cannot be closed
+    if (m_connection->hasOpenStatements()) {
+      throw sqlitepp::DatabaseError(SQLITE_BUSY);
+    }
+    m_connection->release();
+    int result = sqlite3_close(m_handle);
+    if (result == SQLITE_OK) {
+      m_connection.reset();
+      setOpen(false);
+    } else {
+      throw sqlitepp::DatabaseError(result);
+    }
+  }
+}
+
+void Database::disableQueryCache() {
+  requireOpen();
+  m_connection->disableCache();
+}
+
+void Database::enableQueryCache(const std::size_t capacity) {
+  requireOpen();
+  m_connection->enableCache(capacity);
+}
+
+void Database::interrupt() {
+  requireOpen();
+  sqlite3_interrupt(m_handle);
+}
+
+void Database::execute(const std::string& sql) {
+  requireOpen();
+  std::shared_ptr<Statement> statement = prepare(sql);
+  statement->step();
+}
+
+int Database::lastInsertRowId() const {
+  requireOpen();
+  return sqlite3_last_insert_rowid(m_handle);
+}
+
+void Database::open(const std::string& file) {
+  open(file, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+}
+
+void Database::open(const std::string& file, const int flags) {
+  if (isOpen()) {
+    throw std::logic_error("sqlitepp::Database::open(std::string&): "
+                           "Database already open");
+  }
+  int result = sqlite3_open_v2(file.c_str(), &m_handle, flags, NULL);
+
+  if (m_handle == NULL) {
+    throw std::runtime_error("sqlitepp::Database::open(std::string&): "
+                             "Can't allocate memory");
+  }
+
+  if (result == SQLITE_OK) {
+    const bool immutable = sqlite3_db_readonly(m_handle, "main") == 1
+        && (flags & SQLITE_OPEN_URI) != 0
+        && sqlite3_uri_boolean(sqlite3_db_filename(m_handle, "main"),
+                               "immutable", 0);
+    m_connection = std::make_shared<detail::Connection>(m_handle, immutable);
+    setOpen(true);
+  } else {
+    std::string errorMessage = sqlite3_errmsg(m_handle);
+    sqlite3_close(m_handle);
+    throw sqlitepp::DatabaseError(result, errorMessage);
+  }
+}
+
+void Database::openImmutable(const std::string& file,
+                             const sqlite3_int64 mmapSize) {
+  // the file name is percent-encoded so that it can be used in a URI
+  std::ostringstream uri;
+  uri << "file:";
+  for (const char c : file) {
+    if (std::isalnum(static_cast<unsigned char>(c))
+        || std::strchr("/-_.~", c) != NULL) {
+      uri << c;
+    } else {
+      char buffer[4];
+      snprintf(buffer, sizeof(buffer), "%%%02X",
+               static_cast<unsigned char>(c));
+      uri << buffer;
+    }
+  }
+  uri << "?mode=ro&immutable=1";
+  open(uri.str(), SQLITE_OPEN_READONLY | SQLITE_OPEN_URI);
+  try {
+    execute("PRAGMA mmap_size=" + std::to_string(mmapSize) + ";");
+  } catch (...) {
+    close();
+    throw;
+  }
+}
+
+std::vector<std::string> Database::checkPlan(const std::string& sql) {
+  // the plan refers to tables by their alias, so the names are mapped to
+  // the tables the statement reads
+  const std::vector<std::string> readTables = this->readTables(sql);
+  const std::vector<std::string> tokens = tokenizeSql(sql);
+  std::vector<std::string> tables;
+  for (const std::string& name : explain(sql).fullScans()) {
+    const std::string* table = resolvePlanTable(name, tokens, readTables);
+    if (table != NULL && (m_planCheckMinimumRows <= 0
+        || tableRowCount(*table) >= m_planCheckMinimumRows)) {
+      tables.push_back(*table);
+    }
+  }
+  removeDuplicates(&tables);
+  return tables;
+}
+
+QueryPlan Database::explain(const std::string& sql) {
+  std::shared_ptr<Statement> statement = prepareStatement(
+      "EXPLAIN QUERY PLAN " + sql, false);
+  std::vector<QueryPlanNode> nodes;
+  while (statement->step()) {
+    nodes.push_back(parsePlanNode(
+        sqlite3_column_int(statement->m_handle, 0),
+        sqlite3_column_int(statement->m_handle, 1),
+        reinterpret_cast<const char*>(
+            sqlite3_column_text(statement->m_handle, 3))));
+  }
+  QueryPlan plan;
+  plan.nodes = buildPlanTree(nodes, 0);
+  return plan;
+}
+
+std::vector<std::string> Database::readTables(const std::string& sql) {
+  TableAccess access;
+  sqlite3_set_authorizer(m_handle, &authorize, &access);
+  sqlite3_stmt* statementHandle = NULL;
+  const int result = sqlite3_prepare_v2(m_handle, sql.c_str(), sql.size(),
+                                        &statementHandle, NULL);
+  sqlite3_set_authorizer(m_handle, NULL, NULL);
+  if (result != SQLITE_OK) {
+    throw DatabaseError(result, sqlite3_errmsg(m_handle));
+  }
+  sqlite3_finalize(statementHandle);
+  removeDuplicates(&access.readTables);
+  return access.readTables;
+}
+
+std::shared_ptr<Statement> Database::prepare(const std::string& sql) {
+  return prepareStatement(sql, true);
+}
+
+std::shared_ptr<Statement> Database::prepareStatement(const std::string& sql,
+                                                      const bool checkPlan) {
+  requireOpen();
+  std::vector<std::string> planWarnings;
+  if (checkPlan && m_planCheckAction != PlanCheckAction::kIgnore) {
+    planWarnings = this->checkPlan(sql);
+    if (!planWarnings.empty()
+        && m_planCheckAction == PlanCheckAction::kReject) {
+      throw QueryPlanError(sql, planWarnings);
+    }
+  }
+  // if the query cache or the change feed is enabled, the authorizer records
+  // the tables and savepoints the statement accesses
+  TableAccess access;
+  const bool tracked = m_connection->tracksStatements();
+  if (tracked) {
+    sqlite3_set_authorizer(m_handle, &authorize, &access);
+  }
+  sqlite3_stmt* statementHandle;
+  int result = sqlite3_prepare_v2(m_handle, sql.c_str(), sql.size(),
+                                  &statementHandle, NULL);
+  if (tracked) {
+    sqlite3_set_authorizer(m_handle, NULL, NULL);
+    removeDuplicates(&access.readTables);
+    removeDuplicates(&access.writeTables);
+  }
+  if (result != SQLITE_OK) {
+    throw DatabaseError(result, sqlite3_errmsg(m_handle));
+  }
+  if (statementHandle == NULL) {
+    throw std::runtime_error("Statement handle is NULL");
+  }
+  auto statement = std::shared_ptr<Statement>(
+      new Statement(statementHandle, m_connection));
+  statement->m_tracked = tracked;
+  statement->m_changesSchema = access.changesSchema;
+  statement->m_savepointOperation.swap(access.savepointOperation);
+  statement->m_savepointName.swap(access.savepointName);
+  statement->m_readTables.swap(access.readTables);
+  statement->m_writeTables.swap(access.writeTables);
+  statement->m_planWarnings.swap(planWarnings);
+  statement->setInstancePointer(std::weak_ptr<Statement>(statement));
+  return statement;
+}
+
+int Database::subscribeChanges(const ChangeCallback& callback) {
+  requireOpen();
+  if (!callback) {
+    throw std::invalid_argument("Change callback is empty");
+  }
+  return m_connection->addSubscriber(callback,
+                                     std::shared_ptr<ChangeQueue>());
+}
+
+int Database::subscribeChanges(const std::shared_ptr<ChangeQueue>& queue) {
+  requireOpen();
+  if (!queue) {
+    throw std::invalid_argument("Change queue is empty");
+  }
+  return m_connection->addSubscriber(ChangeCallback(), queue);
+}
+
+void Database::unsubscribeChanges(const int subscription) {
+  requireOpen();
+  m_connection->removeSubscriber(subscription);
+}
+
+void Database::setPlanCheck(const PlanCheckAction action,
+                            const sqlite3_int64 minimumRows) {
+  requireOpen();
+  m_planCheckAction = action;
+  m_planCheckMinimumRows = minimumRows;
+}
+
+sqlite3_int64 Database::tableRowCount(const std::string& table) {
+  // the first number of a sqlite_stat1 entry is the row count of the table
+  try {
+    std::shared_ptr<Statement> statement = prepareStatement(
+        "SELECT stat FROM sqlite_stat1 WHERE tbl = ? LIMIT 1;", false);
+    statement->bind(1, table);
+    if (statement->step()) {
+      return sqlite3_column_int64(statement->m_handle, 0);
+    }
+  } catch (const DatabaseError&) {
+    // there is no sqlite_stat1 table
+  }
+  std::string quotedTable;
+  for (const char c : table) {
+    quotedTable += c;
+    if (c == '"') {
+      quotedTable += c;
+    }
+  }
+  try {
+    std::shared_ptr<Statement> statement = prepareStatement(
+        "SELECT count(*) FROM \"" + quotedTable + "\";", false);
+    statement->step();
+    return sqlite3_column_int64(statement->m_handle, 0);
+  } catch (const DatabaseError&) {
+    // the table cannot be counted, so it is always considered
+    return std::numeric_limits<sqlite3_int64>::max();
+  }
+}
+
+QueryCacheStats Database::queryCacheStats() const {
+  if (isOpen() && m_connection->cache() != NULL) {
+    return m_connection->cache()->stats();
+  }
+  QueryCacheStats stats = QueryCacheStats();
+  return stats;
+}
+
+ResultSet::ResultSet(const std::shared_ptr<Statement> statement)
+    : m_statement(statement), m_row(0), m_rowCount(0),
+      m_cachedColumnCount(0), m_partial(false) {
+}
+
+ResultSet::ResultSet(const std::shared_ptr<Statement> statement,
+    const std::shared_ptr<const detail::CachedResult>& cached,
+    const bool partial)
+    : m_statement(statement), m_cached(cached), m_row(0),
+      m_rowCount(cached->rowCount()),
+      m_cachedColumnCount(cached->columnCount()), m_partial(partial) {
+}
+
+bool ResultSet::next() {
+  if (m_cached) {
+    m_statement->requireOpenIfChecked();
+    if (m_row < m_rowCount) {
+      m_row++;
+    }
+    if (m_partial && m_row == m_rowCount) {
+      // the statement is still positioned on the first row that was not
+      // fetched
+      m_cached.reset();
+    }
+    return canRead();
+  }
+  return m_statement->step();
+}
+
+int ResultSet::readCachedType(const int column) const {
+  return m_cached->view(m_row, column).type;
+}
+
+double ResultSet::readCachedDouble(const int column) const {
+  return m_cached->view(m_row, column).toDouble();
+}
+
+int ResultSet::readCachedInt(const int column) const {
+  return m_cached->view(m_row, column).toInt();
+}
+
+std::string ResultSet::readCachedString(const int column) const {
+  return m_cached->view(m_row, column).toString();
+}
+
+int Row::columnCount() const {
+  return static_cast<int>(m_values.size());
+}
+
+int Row::columnType(const int column) const {
+  if (column < 0 || column >= columnCount()) {
+    return SQLITE_NULL;
+  }
+  return m_values[column].type;
+}
+
+double Row::readDouble(const int column) const {
+  return view(column).toDouble();
+}
+
+int Row::readInt(const int column) const {
+  return view(column).toInt();
+}
+
+std::string Row::readString(const int column) const {
+  return view(column).toString();
+}
+
+void Row::assign(sqlite3_stmt* handle) {
+  const int columns = sqlite3_data_count(handle);
+  m_values.resize(columns);
+  for (int i = 0; i < columns; i++) {
+    Value& value = m_values[i];
+    // assign keeps the capacity of the string, so slots are reused
+    value.type = detail::decodeColumn(handle, i, &value.integer, &value.real,
+        [&value](const char* data, const std::size_t size) {
+          value.text.assign(data, size);
+        });
+  }
+}
+
+detail::ValueView Row::view(const int column) const {
+  detail::ValueView view;
+  if (column < 0 || column >= columnCount()) {
+    return view;
+  }
+  const Value& value = m_values[column];
+  view.type = value.type;
+  view.integer = value.integer;
+  view.real = value.real;
+  view.text = value.text.data();
+  view.size = value.text.size();
+  return view;
+}
+
+PrefetchCursor::iterator::iterator(PrefetchCursor* cursor)
+    : m_cursor(cursor) {
+}
+
+const Row& PrefetchCursor::iterator::operator*() const {
+  return m_cursor->m_slots[m_cursor->m_head.load(std::memory_order_relaxed)];
+}
+
+const Row* PrefetchCursor::iterator::operator->() const {
+  return &**this;
+}
+
+PrefetchCursor::iterator& PrefetchCursor::iterator::operator++() {
+  if (!m_cursor->advance()) {
+    m_cursor = NULL;
+  }
+  return *this;
+}
+
+bool PrefetchCursor::iterator::operator==(const iterator& other) const {
+  return m_cursor == other.m_cursor;
+}
+
+bool PrefetchCursor::iterator::operator!=(const iterator& other) const {
+  return m_cursor != other.m_cursor;
+}
+
+PrefetchCursor::PrefetchCursor(const std::shared_ptr<Statement>& statement,
+                               const std::size_t capacity)
+    : m_statement(statement), m_slots(capacity + 1), m_head(0), m_tail(0),
+      m_done(false), m_stopped(false), m_consumerWaiting(false),
+      m_producerWaiting(false), m_started(false), m_hasRow(false) {
+  if (capacity == 0) {
+    throw std::invalid_argument("PrefetchCursor capacity must not be zero");
+  }
+  m_statement->requireOpen();
+  m_thread = std::thread(&PrefetchCursor::produce, this);
+}
+
+PrefetchCursor::~PrefetchCursor() {
+  m_stopped.store(true);
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+  }
+  m_slotAvailable.notify_one();
+  m_thread.join();
+}
+
+bool PrefetchCursor::advance() {
+  if (m_hasRow) {
+    const std::size_t head = m_head.load(std::memory_order_relaxed);
+    m_head.store((head + 1) % m_slots.size());
+    if (m_producerWaiting.load()) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_slotAvailable.notify_one();
+    }
+  }
+  m_hasRow = waitForRow();
+  return m_hasRow;
+}
+
+PrefetchCursor::iterator PrefetchCursor::begin() {
+  if (!m_started) {
+    m_started = true;
+    m_hasRow = waitForRow();
+  }
+  return iterator(m_hasRow ? this : NULL);
+}
+
+PrefetchCursor::iterator PrefetchCursor::end() {
+  return iterator(NULL);
+}
+
+void PrefetchCursor::produce() {
+  try {
+    while (!m_stopped.load() && m_statement->step()) {
+      if (!waitForSlot()) {
+        break;
+      }
+      const std::size_t tail = m_tail.load(std::memory_order_relaxed);
+      m_slots[tail].assign(m_statement->m_handle);
+      m_tail.store((tail + 1) % m_slots.size());
+      if (m_consumerWaiting.load()) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_rowAvailable.notify_one();
+      }
+    }
+  } catch (...) {
+    m_error = std::current_exception();
+  }
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_done.store(true);
+  m_rowAvailable.notify_one();
+}
+
+bool PrefetchCursor::waitForRow() {
+  const std::size_t head = m_head.load(std::memory_order_relaxed);
+  const auto ready = [this, head] {
+    return head != m_tail.load() || m_done.load();
+  };
+  for (int i = 0; i < kPrefetchSpins && !ready(); i++) {
+    std::this_thread::yield();
+  }
+  if (!ready()) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_consumerWaiting.store(true);
+    m_rowAvailable.wait(lock, ready);
+    m_consumerWaiting.store(false);
+  }
+  if (head != m_tail.load()) {
+    return true;
+  }
+  // the producer is done and all rows have been read
+  if (m_error) {
+    std::exception_ptr error = m_error;
+    m_error = std::exception_ptr();
+    std::rethrow_exception(error);
+  }
+  return false;
+}
+
+bool PrefetchCursor::waitForSlot() {
+  const std::size_t next = (m_tail.load(std::memory_order_relaxed) + 1)
+      % m_slots.size();
+  const auto ready = [this, next] {
+    return next != m_head.load() || m_stopped.load();
+  };
+  for (int i = 0; i < kPrefetchSpins && !ready(); i++) {
+    std::this_thread::yield();
+  }
+  if (!ready()) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_producerWaiting.store(true);
+    m_slotAvailable.wait(lock, ready);
+    m_producerWaiting.store(false);
+  }
+  return !m_stopped.load();
+}
+
+ShardedResultSet::ShardedResultSet(const std::vector<ResultSet>& resultSets,
+                                   const int mergeColumn)
+    : m_resultSets(resultSets), m_mergeColumn(mergeColumn), m_current(0) {
+  selectCurrent();
+}
+
+bool ShardedResultSet::canRead() const {
+  return m_current < m_resultSets.size()
+      && m_resultSets[m_current].canRead();
+}
+
+int ShardedResultSet::columnCount() const {
+  return current().columnCount();
+}
+
+const ResultSet& ShardedResultSet::current() const {
+  if (!canRead()) {
+    throw std::logic_error("Trying to read from statement without data");
+  }
+  return m_resultSets[m_current];
+}
+
+std::size_t ShardedResultSet::currentShard() const {
+  current();
+  return m_current;
+}
+
+bool ShardedResultSet::next() {
+  if (m_current < m_resultSets.size()) {
+    m_resultSets[m_current].next();
+  }
+  selectCurrent();
+  return canRead();
+}
+
+double ShardedResultSet::readDouble(const int column) const {
+  return current().readDouble(column);
+}
+
+int ShardedResultSet::readInt(const int column) const {
+  return current().readInt(column);
+}
+
+std::string ShardedResultSet::readString(const int column) const {
+  return current().readString(column);
+}
+
+void ShardedResultSet::selectCurrent() {
+  if (m_mergeColumn < 0) {
+    while (m_current < m_resultSets.size()
+           && !m_resultSets[m_current].canRead()) {
+      m_current++;
+    }
+    return;
+  }
+  // the number of shards is small, so a linear scan is cheaper than a heap
+  std::size_t selected = m_resultSets.size();
+  for (std::size_t i = 0; i < m_resultSets.size(); i++) {
+    if (!m_resultSets[i].canRead()) {
+      continue;
+    }
+    if (selected == m_resultSets.size()
+        || compareColumns(m_resultSets[i], m_resultSets[selected],
+                          m_mergeColumn) < 0) {
+      selected = i;
+    }
+  }
+  m_current = selected;
+}
+
+ShardedStatement::ShardedStatement(
+    const std::vector<std::shared_ptr<Statement>>& statements)
+    : m_statements(statements) {
+}
+
+void ShardedStatement::applyBindings(const std::size_t shard) {
+  Statement& statement = *m_statements[shard];
+  for (const Binding& binding : m_bindings) {
+    switch (binding.type) {
+      case SQLITE_INTEGER:
+        statement.bind(binding.index, binding.integer);
+        break;
+      case SQLITE_FLOAT:
+        statement.bind(binding.index, binding.real);
+        break;
+      default:
+        statement.bind(binding.index, binding.text);
+        break;
+    }
+  }
+}
+
+void ShardedStatement::bind(const int index, const double value) {
+  Binding& stored = binding(index);
+  stored.type = SQLITE_FLOAT;
+  stored.real = value;
+}
+
+void ShardedStatement::bind(const std::string& name, const double value) {
+  bind(getParameterIndex(name), value);
+}
+
+void ShardedStatement::bind(const int index, const int value) {
+  Binding& stored = binding(index);
+  stored.type = SQLITE_INTEGER;
+  stored.integer = value;
+}
+
+void ShardedStatement::bind(const std::string& name, const int value) {
+  bind(getParameterIndex(name), value);
+}
+
+void ShardedStatement::bind(const int index, const std::string& value) {
+  Binding& stored = binding(index);
+  stored.type = SQLITE_TEXT;
+  stored.text = value;
+}
+
+void ShardedStatement::bind(const std::string& name,
+                            const std::string& value) {
+  bind(getParameterIndex(name), value);
+}
+
+ShardedStatement::Binding& ShardedStatement::binding(const int index) {
+  m_statements.front()->requireOpen();
+  if (index < 1 || index > sqlite3_bind_parameter_count(
+          m_statements.front()->m_handle)) {
+    throw std::out_of_range("Bind index out of range: "
+                            + std::to_string(index));
+  }
+  for (Binding& binding : m_bindings) {
+    if (binding.index == index) {
+      return binding;
+    }
+  }
+  m_bindings.push_back(Binding());
+  m_bindings.back().index = index;
+  return m_bindings.back();
+}
+
+void ShardedStatement::close() {
+  for (const std::shared_ptr<Statement>& statement : m_statements) {
+    statement->close();
+  }
+}
+
+ResultSet ShardedStatement::execute(const std::string& key) {
+  const std::size_t shard = shardIndex(key, m_statements.size());
+  applyBindings(shard);
+  return m_statements[shard]->execute();
+}
+
+ResultSet ShardedStatement::execute(const sqlite3_int64 key) {
+  const std::size_t shard = shardIndex(key, m_statements.size());
+  applyBindings(shard);
+  return m_statements[shard]->execute();
+}
+
+ShardedResultSet ShardedStatement::executeAll() {
+  std::vector<ResultSet> resultSets;
+  resultSets.reserve(m_statements.size());
+  for (std::size_t i = 0; i < m_statements.size(); i++) {
+    applyBindings(i);
+    resultSets.push_back(m_statements[i]->execute());
+  }
+  return ShardedResultSet(resultSets, -1);
+}
+
+ShardedResultSet ShardedStatement::executeMerged(const int column) {
+  if (column < 0) {
+    throw std::out_of_range("Merge column out of range: "
+                            + std::to_string(column));
+  }
+  std::vector<ResultSet> resultSets;
+  resultSets.reserve(m_statements.size());
+  for (std::size_t i = 0; i < m_statements.size(); i++) {
+    applyBindings(i);
+    resultSets.push_back(m_statements[i]->execute());
+  }
+  return ShardedResultSet(resultSets, column);
+}
+
+int ShardedStatement::getParameterIndex(const std::string& name) const {
+  return m_statements.front()->getParameterIndex(name);
+}
+
+bool ShardedStatement::reset() {
+  bool success = true;
+  for (const std::shared_ptr<Statement>& statement : m_statements) {
+    success = statement->reset() && success;
+  }
+  return success;
+}
+
+ShardedDatabase::ShardedDatabase(const std::vector<std::string>& files) {
+  if (files.empty()) {
+    throw std::invalid_argument("ShardedDatabase requires at least one file");
+  }
+  for (const std::string& file : files) {
+    m_shards.emplace_back(new Database(file));
+  }
+}
+
+void ShardedDatabase::begin() {
+  for (std::size_t i = 0; i < m_shards.size(); i++) {
+    try {
+      m_shards[i]->execute("BEGIN;");
+    } catch (...) {
+      for (std::size_t j = 0; j < i; j++) {
+        try {
+          m_shards[j]->execute("ROLLBACK;");
+        } catch (const DatabaseError&) {
+          // the original error is more relevant than a failed rollback
+        }
+      }
+      throw;
+    }
+  }
+}
+
+void ShardedDatabase::close() {
+  for (const std::unique_ptr<Database>& shard : m_shards) {
+    shard->close();
+  }
+}
+
+void ShardedDatabase::commit() {
+  for (std::size_t i = 0; i < m_shards.size(); i++) {
+    try {
+      m_shards[i]->execute("COMMIT;");
+    } catch (...) {
+      for (std::size_t j = i; j < m_shards.size(); j++) {
+        try {
+          m_shards[j]->execute("ROLLBACK;");
+        } catch (const DatabaseError&) {
+          // the transaction may already have been rolled back
+        }
+      }
+      throw;
+    }
+  }
+}
+
+void ShardedDatabase::execute(const std::string& sql) {
+  for (const std::unique_ptr<Database>& shard : m_shards) {
+    shard->execute(sql);
+  }
+}
+
+std::shared_ptr<ShardedStatement> ShardedDatabase::prepare(
+    const std::string& sql) {
+  std::vector<std::shared_ptr<Statement>> statements;
+  statements.reserve(m_shards.size());
+  for (const std::unique_ptr<Database>& shard : m_shards) {
+    statements.push_back(shard->prepare(sql));
+  }
+  return std::shared_ptr<ShardedStatement>(new ShardedStatement(statements));
+}
+
+void ShardedDatabase::rollback() {
+  for (const std::unique_ptr<Database>& shard : m_shards) {
+    shard->execute("ROLLBACK;");
+  }
+}
+
+Database& ShardedDatabase::shard(const std::size_t index) {
+  if (index >= m_shards.size()) {
+    throw std::out_of_range("Shard index out of range: "
+                            + std::to_string(index));
+  }
+  return *m_shards[index];
+}
+
+std::size_t ShardedDatabase::shardCount() const {
+  return m_shards.size();
+}
+
+std::size_t ShardedDatabase::shardFor(const std::string& key) const {
+  return shardIndex(key, m_shards.size());
+}
+
+std::size_t ShardedDatabase::shardFor(const sqlite3_int64 key) const {
+  return shardIndex(key, m_shards.size());
+}
+
+CheckpointManager::CheckpointManager(const std::string& file,
+    const int frameThreshold, const std::chrono::milliseconds idleInterval)
+    : m_state(std::make_shared<detail::CheckpointState>(frameThreshold)),
+      m_database(file), m_idleInterval(idleInterval) {
+  if (frameThreshold <= 0) {
+    throw std::invalid_argument("Checkpoint frame threshold must be positive");
+  }
+  if (idleInterval.count() <= 0) {
+    throw std::invalid_argument("Checkpoint idle interval must be positive");
+  }
+  sqlite3_wal_autocheckpoint(m_database.m_handle, 0);
+  m_thread = std::thread(&CheckpointManager::run, this);
+}
+
+CheckpointManager::~CheckpointManager() {
+  stop();
+}
+
+void CheckpointManager::attach(Database* database) {
+  database->requireOpen();
+  const int autoCheckpoint = database->prepare("PRAGMA wal_autocheckpoint;")
+      ->execute().readInt(0);
+  {
+    std::lock_guard<std::mutex> lock(m_state->mutex);
+    if (m_state->stopped) {
+      throw std::logic_error("CheckpointManager has been stopped");
+    }
+    // the WAL hook replaces the automatic checkpoints
+    sqlite3_wal_hook(database->m_handle, &detail::CheckpointState::walHook,
+                     m_state.get());
+    m_state->connections.emplace_back(database->m_handle, autoCheckpoint);
+  }
+  database->m_connection->setWalObserver(m_state);
+  const int pageSize = database->prepare("PRAGMA page_size;")->execute()
+      .readInt(0);
+  m_state->pageSize.store(pageSize, std::memory_order_relaxed);
+}
+
+CheckpointStats CheckpointManager::stats() const {
+  std::lock_guard<std::mutex> lock(m_state->mutex);
+  CheckpointStats stats = m_state->stats;
+  stats.walFrames = m_state->walFrames.load(std::memory_order_relaxed);
+  // each frame consists of a page and a 24 byte header
+  stats.walBytes = static_cast<std::int64_t>(stats.walFrames)
+      * (m_state->pageSize.load(std::memory_order_relaxed) + 24);
+  return stats;
+}
+
+void CheckpointManager::stop() {
+  {
+    std::lock_guard<std::mutex> lock(m_state->mutex);
+    m_state->stopped = true;
+  }
+  m_state->wakeUp.notify_one();
+  if (m_thread.joinable()) {
+    m_thread.join();
+  }
+  m_state->detachAll();
+}
+
+void CheckpointManager::run() {
+  std::int64_t lastTruncate = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(m_state->mutex);
+      m_state->wakeUp.wait_for(lock, m_idleInterval / 4, [this] {
+        return m_state->stopped
+            || m_state->walFrames.load() >= m_state->frameThreshold;
+      });
+      if (m_state->stopped) {
+        return;
+      }
+    }
+
+    int frames = m_state->walFrames.load();
+    const std::int64_t lastCommit = m_state->lastCommit.load();
+    const bool idle = lastCommit > lastTruncate
+        && detail::CheckpointState::now() - lastCommit
+            >= std::chrono::duration_cast<std::chrono::microseconds>(
+                m_idleInterval).count();
+    if (frames < m_state->frameThreshold && !idle) {
+      continue;
+    }
+
+    const int mode = idle ? SQLITE_CHECKPOINT_TRUNCATE
+        : SQLITE_CHECKPOINT_PASSIVE;
+    int logFrames = 0;
+    int checkpointedFrames = 0;
+    const auto start = std::chrono::steady_clock::now();
+    const int result = sqlite3_wal_checkpoint_v2(m_database.m_handle, NULL,
+        mode, &logFrames, &checkpointedFrames);
+    const auto duration =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start);
+    m_state->record(result, idle, duration);
+
+    if (result == SQLITE_OK) {
+      if (idle) {
+        lastTruncate = lastCommit;
+      }
+      // unless a commit reported a new size in the meantime, only the
+      // frames that were not checkpointed count towards the threshold
+      m_state->walFrames.compare_exchange_strong(frames,
+          std::max(0, logFrames - checkpointedFrames));
+    } else if (!idle) {
+      // do not retry a busy passive checkpoint immediately
+      std::this_thread::sleep_for(m_idleInterval / 4);
+    }
+  }
 }
 
 }  // namespace sqlitepp
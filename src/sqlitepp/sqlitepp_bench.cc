@@ -0,0 +1,399 @@
+// Copyright (C) 2014--2015 Robin Krahl <robin.krahl@ireas.org>
+// MIT license -- http://opensource.org/licenses/MIT
+
+// Load generator that measures the throughput and latency of concurrent
+// readers and writers, each using its own sqlitepp::Database connection.
+// Run sqlitepp_bench --help for a list of the options.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>  // NOLINT(build/c++11)
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+#include "sqlitepp/sqlitepp.h"
+
+namespace {
+
+enum class Storage {
+  kFile,
+  kMemory
+};
+
+enum class Journal {
+  kRollback,
+  kWal
+};
+
+enum class Role {
+  kReader,
+  kWriter,
+  kMixed
+};
+
+struct Options {
+  int readers = 4;
+  int writers = 1;
+  int mixed = 0;
+  double writeRatio = 0.1;
+  int rowSize = 100;
+  int rows = 10000;
+  int duration = 2000;
+  int busyTimeout = 100;
+  std::string file = "/tmp/sqlitepp_bench.db";
+  Storage storage = Storage::kFile;
+  Journal journal = Journal::kRollback;
+  bool matrix = false;
+};
+
+// The results of one thread or, after merging, of one run.  Latencies of
+// successful operations are stored in nanoseconds.
+struct Result {
+  std::vector<std::int64_t> readLatencies;
+  std::vector<std::int64_t> writeLatencies;
+  std::uint64_t busy = 0;
+  std::uint64_t locked = 0;
+  std::uint64_t errors = 0;
+};
+
+// the memdb VFS shares the database between the connections of the process
+// and uses the same locking and busy handling as database files
+const char kMemoryUri[] = "file:/sqlitepp_bench?vfs=memdb";
+
+void printUsage(const char* name) {
+  std::cout << "Usage: " << name << " [options]\n"
+      << "\n"
+      << "  --readers=N        number of reading threads (default 4)\n"
+      << "  --writers=N        number of writing threads (default 1)\n"
+      << "  --mixed=N          number of threads that read and write "
+      << "(default 0)\n"
+      << "  --write-ratio=R    share of writes for mixed threads "
+      << "(default 0.1)\n"
+      << "  --row-size=N       bytes per value (default 100)\n"
+      << "  --rows=N           number of rows in the table (default 10000)\n"
+      << "  --duration=MS      duration of each run (default 2000)\n"
+      << "  --busy-timeout=MS  SQLite3 busy timeout (default 100)\n"
+      << "  --storage=S        file or memory (default file)\n"
+      << "  --journal=J        rollback or wal (default rollback)\n"
+      << "  --file=PATH        database file (default /tmp/sqlitepp_bench.db)\n"
+      << "  --matrix           run all storage and journal combinations\n"
+      << "                     (in-memory databases only use rollback)\n";
+}
+
+bool parseOption(const std::string& argument, const std::string& name,
+                 std::string* value) {
+  const std::string prefix = "--" + name + "=";
+  if (argument.compare(0, prefix.size(), prefix) != 0) {
+    return false;
+  }
+  *value = argument.substr(prefix.size());
+  return true;
+}
+
+Options parseOptions(const int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    const std::string argument = argv[i];
+    std::string value;
+    if (argument == "--help") {
+      printUsage(argv[0]);
+      std::exit(0);
+    } else if (argument == "--matrix") {
+      options.matrix = true;
+    } else if (parseOption(argument, "readers", &value)) {
+      options.readers = std::stoi(value);
+    } else if (parseOption(argument, "writers", &value)) {
+      options.writers = std::stoi(value);
+    } else if (parseOption(argument, "mixed", &value)) {
+      options.mixed = std::stoi(value);
+    } else if (parseOption(argument, "write-ratio", &value)) {
+      options.writeRatio = std::stod(value);
+    } else if (parseOption(argument, "row-size", &value)) {
+      options.rowSize = std::stoi(value);
+    } else if (parseOption(argument, "rows", &value)) {
+      options.rows = std::stoi(value);
+    } else if (parseOption(argument, "duration", &value)) {
+      options.duration = std::stoi(value);
+    } else if (parseOption(argument, "busy-timeout", &value)) {
+      options.busyTimeout = std::stoi(value);
+    } else if (parseOption(argument, "file", &value)) {
+      options.file = value;
+    } else if (parseOption(argument, "storage", &value)
+               && (value == "file" || value == "memory")) {
+      options.storage = value == "file" ? Storage::kFile : Storage::kMemory;
+    } else if (parseOption(argument, "journal", &value)
+               && (value == "rollback" || value == "wal")) {
+      options.journal = value == "rollback" ? Journal::kRollback
+                                            : Journal::kWal;
+    } else {
+      throw std::invalid_argument("Unknown option: " + argument);
+    }
+  }
+  if (options.readers < 0 || options.writers < 0 || options.mixed < 0
+      || options.readers + options.writers + options.mixed == 0) {
+    throw std::invalid_argument("At least one thread is required");
+  }
+  if (options.writeRatio < 0 || options.writeRatio > 1) {
+    throw std::invalid_argument("The write ratio must be in [0, 1]");
+  }
+  if (options.rows < 1 || options.rowSize < 0 || options.duration < 1) {
+    throw std::invalid_argument("Invalid rows, row size or duration");
+  }
+  return options;
+}
+
+void openDatabase(const Options& options, sqlitepp::Database* database) {
+  if (options.storage == Storage::kFile) {
+    database->open(options.file);
+  } else {
+    database->open(kMemoryUri, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE
+                   | SQLITE_OPEN_URI);
+  }
+  database->execute("PRAGMA busy_timeout=" +
+                    std::to_string(options.busyTimeout) + ";");
+}
+
+// Creates and fills the benchmark table and returns the journal mode that
+// SQLite3 actually uses (in-memory databases do not support WAL).
+std::string setUp(const Options& options, sqlitepp::Database* database) {
+  if (options.storage == Storage::kFile) {
+    std::remove(options.file.c_str());
+    std::remove((options.file + "-wal").c_str());
+    std::remove((options.file + "-shm").c_str());
+    std::remove((options.file + "-journal").c_str());
+  }
+  openDatabase(options, database);
+  const std::string journalMode = database->prepare(
+      options.journal == Journal::kWal ? "PRAGMA journal_mode=WAL;"
+                                       : "PRAGMA journal_mode=DELETE;")
+      ->execute().readString(0);
+  database->execute("DROP TABLE IF EXISTS bench;");
+  database->execute("CREATE TABLE bench (id INTEGER PRIMARY KEY, "
+                    "value TEXT);");
+  const std::string value(options.rowSize, 'x');
+  database->execute("BEGIN;");
+  std::shared_ptr<sqlitepp::Statement> insert = database->prepare(
+      "INSERT INTO bench (id, value) VALUES (?, ?);");
+  for (int id = 0; id < options.rows; id++) {
+    insert->bind(1, id);
+    insert->bind(2, value);
+    insert->execute();
+    insert->reset();
+  }
+  insert->close();
+  database->execute("COMMIT;");
+  return journalMode;
+}
+
+void recordError(const sqlitepp::DatabaseError& error, Result* result) {
+  switch (error.errorCode()) {
+    case SQLITE_BUSY:
+      result->busy++;
+      break;
+    case SQLITE_LOCKED:
+      result->locked++;
+      break;
+    default:
+      result->errors++;
+  }
+}
+
+void runWorker(const Options& options, const Role role, const int seed,
+               const std::atomic<bool>* running, Result* result) {
+  std::mt19937 random(seed);
+  std::uniform_int_distribution<int> ids(0, options.rows - 1);
+  std::bernoulli_distribution writes(
+      role == Role::kReader ? 0 : role == Role::kWriter ? 1
+                                                        : options.writeRatio);
+  const std::string value(options.rowSize, 'y');
+
+  sqlitepp::Database database;
+  std::shared_ptr<sqlitepp::Statement> read;
+  std::shared_ptr<sqlitepp::Statement> write;
+  try {
+    openDatabase(options, &database);
+    read = database.prepare("SELECT value FROM bench WHERE id = ?;");
+    write = database.prepare("UPDATE bench SET value = ? WHERE id = ?;");
+  } catch (const sqlitepp::DatabaseError& e) {
+    recordError(e, result);
+    return;
+  }
+
+  while (running->load(std::memory_order_relaxed)) {
+    const bool isWrite = writes(random);
+    const int id = ids(random);
+    const auto start = std::chrono::steady_clock::now();
+    bool success = true;
+    try {
+      if (isWrite) {
+        write->bind(1, value);
+        write->bind(2, id);
+        write->execute();
+      } else {
+        read->bind(1, id);
+        sqlitepp::ResultSet resultSet = read->execute();
+        if (resultSet.canRead()) {
+          resultSet.readString(0);
+        }
+      }
+    } catch (const sqlitepp::DatabaseError& e) {
+      recordError(e, result);
+      success = false;
+    }
+    (isWrite ? write : read)->reset();
+    // failed operations are only counted, they would skew the latencies
+    if (success) {
+      const auto latency =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start).count();
+      (isWrite ? result->writeLatencies : result->readLatencies).push_back(
+          latency);
+    }
+  }
+  read->close();
+  write->close();
+}
+
+std::int64_t percentile(const std::vector<std::int64_t>& sorted,
+                        const double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  const std::size_t rank = static_cast<std::size_t>(p * sorted.size());
+  return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+void printHeader() {
+  std::cout << std::left << std::setw(8) << "storage"
+      << std::setw(10) << "journal" << std::setw(7) << "op"
+      << std::right << std::setw(10) << "ops"
+      << std::setw(12) << "ops/s" << std::setw(10) << "p50 us"
+      << std::setw(10) << "p99 us" << std::setw(10) << "p999 us"
+      << std::endl;
+}
+
+void printLatencies(const std::string& storage, const std::string& journal,
+                    const std::string& operation,
+                    std::vector<std::int64_t>* latencies,
+                    const double seconds) {
+  std::sort(latencies->begin(), latencies->end());
+  std::cout << std::left << std::setw(8) << storage
+      << std::setw(10) << journal << std::setw(7) << operation
+      << std::right << std::setw(10) << latencies->size()
+      << std::setw(12) << std::fixed << std::setprecision(0)
+      << latencies->size() / seconds << std::setprecision(1)
+      << std::setw(10) << percentile(*latencies, 0.5) / 1000.0
+      << std::setw(10) << percentile(*latencies, 0.99) / 1000.0
+      << std::setw(10) << percentile(*latencies, 0.999) / 1000.0
+      << std::endl;
+}
+
+void runBenchmark(const Options& options) {
+  // the setup connection keeps a shared in-memory database alive
+  sqlitepp::Database database;
+  const std::string journalMode = setUp(options, &database);
+
+  std::vector<Role> roles;
+  roles.insert(roles.end(), options.readers, Role::kReader);
+  roles.insert(roles.end(), options.writers, Role::kWriter);
+  roles.insert(roles.end(), options.mixed, Role::kMixed);
+  std::vector<Result> results(roles.size());
+  std::vector<std::thread> threads;
+  std::atomic<bool> running(true);
+
+  const auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < roles.size(); i++) {
+    threads.emplace_back(runWorker, std::cref(options), roles[i],
+                         static_cast<int>(i) + 1, &running, &results[i]);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(options.duration));
+  running = false;
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  const double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+  Result total;
+  for (const Result& result : results) {
+    total.readLatencies.insert(total.readLatencies.end(),
+                               result.readLatencies.begin(),
+                               result.readLatencies.end());
+    total.writeLatencies.insert(total.writeLatencies.end(),
+                                result.writeLatencies.begin(),
+                                result.writeLatencies.end());
+    total.busy += result.busy;
+    total.locked += result.locked;
+    total.errors += result.errors;
+  }
+
+  const std::string storage = options.storage == Storage::kFile ? "file"
+                                                                 : "memory";
+  printLatencies(storage, journalMode, "read", &total.readLatencies, seconds);
+  printLatencies(storage, journalMode, "write", &total.writeLatencies,
+                 seconds);
+  std::cout << std::left << std::setw(8) << storage << std::setw(10)
+      << journalMode << "busy: " << total.busy << ", locked: "
+      << total.locked << ", other errors: " << total.errors << std::endl;
+
+  database.close();
+  if (options.storage == Storage::kFile) {
+    std::remove(options.file.c_str());
+    std::remove((options.file + "-wal").c_str());
+    std::remove((options.file + "-shm").c_str());
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  try {
+    options = parseOptions(argc, argv);
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    printUsage(argv[0]);
+    return 1;
+  }
+
+  std::cout << options.readers << " readers, " << options.writers
+      << " writers, " << options.mixed << " mixed (write ratio "
+      << options.writeRatio << "), " << options.rows << " rows of "
+      << options.rowSize << " bytes, " << options.duration << " ms"
+      << std::endl;
+  printHeader();
+
+  std::vector<Storage> storages = {options.storage};
+  std::vector<Journal> journals = {options.journal};
+  if (options.matrix) {
+    storages = {Storage::kFile, Storage::kMemory};
+    journals = {Journal::kRollback, Journal::kWal};
+  }
+  try {
+    for (const Storage storage : storages) {
+      for (const Journal journal : journals) {
+        // in-memory databases do not support WAL and would use the
+        // journal mode "memory" instead
+        if (options.matrix && storage == Storage::kMemory
+            && journal == Journal::kWal) {
+          continue;
+        }
+        options.storage = storage;
+        options.journal = journal;
+        runBenchmark(options);
+      }
+    }
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -1,9 +1,14 @@
 // Copyright (C) 2014--2015 Robin Krahl <robin.krahl@ireas.org>
 // MIT license -- http://opensource.org/licenses/MIT
 
+#include <chrono>  // NOLINT(build/c++11)
+#include <cstdio>
 #include <stdexcept>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
 #include "gtest/gtest.h"
 #include "sqlitepp/sqlitepp.h"
 
@@ -98,6 +103,565 @@ TEST(Database, query) {
   EXPECT_FALSE(resultSet.canRead());
 }
 
+TEST(Database, checkedRead) {
+  sqlitepp::Database database("/tmp/test.db");
+  std::shared_ptr<sqlitepp::Statement> statement = database.prepare(
+      "SELECT id, value FROM test WHERE id = 0;");
+  sqlitepp::ResultSet resultSet = statement->execute();
+  EXPECT_FALSE(resultSet.canRead());
+  if (sqlitepp::CheckPolicy::enabled) {
+    EXPECT_THROW(resultSet.readInt(0), std::logic_error);
+    EXPECT_THROW(resultSet.readString(1), std::logic_error);
+    statement->close();
+    EXPECT_THROW(statement->bind(1, 1), std::logic_error);
+  }
+  statement->close();
+  EXPECT_THROW(statement->execute(), std::logic_error);
+  EXPECT_THROW(statement->reset(), std::logic_error);
+  database.close();
+  EXPECT_THROW(database.prepare("SELECT 1;"), std::logic_error);
+  EXPECT_THROW(database.execute("SELECT 1;"), std::logic_error);
+  EXPECT_THROW(database.lastInsertRowId(), std::logic_error);
+}
+
+TEST(Database, queryCache) {
+  sqlitepp::Database database("/tmp/test_cache.db");
+  database.execute("DROP TABLE IF EXISTS cached;");
+  database.execute("CREATE TABLE cached (id, value);");
+  database.execute("INSERT INTO cached VALUES (1, 'one');");
+  database.enableQueryCache(1024 * 1024);
+
+  std::shared_ptr<sqlitepp::Statement> select = database.prepare(
+      "SELECT value, id FROM cached WHERE id = :id;");
+  select->bind(":id", 1);
+  sqlitepp::ResultSet resultSet = select->execute();
+  ASSERT_TRUE(resultSet.canRead());
+  EXPECT_EQ("one", resultSet.readString(0));
+  EXPECT_FALSE(resultSet.next());
+  select->reset();
+  sqlitepp::ResultSet cachedResultSet = select->execute();
+  ASSERT_TRUE(cachedResultSet.canRead());
+  EXPECT_EQ(2, cachedResultSet.columnCount());
+  EXPECT_EQ("one", cachedResultSet.readString(0));
+  EXPECT_EQ(1, cachedResultSet.readInt(1));
+  EXPECT_EQ("1", cachedResultSet.readString(1));
+  EXPECT_FALSE(cachedResultSet.next());
+  sqlitepp::QueryCacheStats stats = database.queryCacheStats();
+  EXPECT_EQ(1u, stats.hits);
+  EXPECT_EQ(1u, stats.misses);
+  EXPECT_EQ(1u, stats.entries);
+  EXPECT_LT(0u, stats.memoryUsage);
+
+  // a write on this connection invalidates the entry
+  database.execute("UPDATE cached SET value = 'uno' WHERE id = 1;");
+  EXPECT_EQ(0u, database.queryCacheStats().entries);
+  select->reset();
+  EXPECT_EQ("uno", select->execute().readString(0));
+
+  // a write on another connection is detected using the data version
+  sqlitepp::Database other("/tmp/test_cache.db");
+  other.execute("UPDATE cached SET value = 'eins' WHERE id = 1;");
+  select->reset();
+  EXPECT_EQ("eins", select->execute().readString(0));
+  EXPECT_EQ(0u, database.queryCacheStats().hits - stats.hits);
+
+  database.disableQueryCache();
+  EXPECT_EQ(0u, database.queryCacheStats().entries);
+}
+
+TEST(Database, queryCacheBindings) {
+  sqlitepp::Database database(":memory:");
+  database.execute("CREATE TABLE cached (x REAL);");
+  database.execute("INSERT INTO cached VALUES (0.1);");
+  database.enableQueryCache(1024 * 1024);
+
+  // the doubles only differ after the 15th significant digit
+  std::shared_ptr<sqlitepp::Statement> select = database.prepare(
+      "SELECT ? = x, ? FROM cached;");
+  select->bind(1, 0.1);
+  select->bind(2, 0.1);
+  sqlitepp::ResultSet first = select->execute();
+  EXPECT_EQ(1, first.readInt(0));
+  EXPECT_EQ(0.1, first.readDouble(1));
+  select->reset();
+  select->bind(1, 0.10000000000000002);
+  select->bind(2, 0.10000000000000002);
+  sqlitepp::ResultSet second = select->execute();
+  EXPECT_EQ(0, second.readInt(0));
+  EXPECT_EQ(0.10000000000000002, second.readDouble(1));
+  EXPECT_EQ(0u, database.queryCacheStats().hits);
+
+  select->reset();
+  select->bind(1, 0.1);
+  select->bind(2, 0.1);
+  EXPECT_EQ(1, select->execute().readInt(0));
+  EXPECT_EQ(1u, database.queryCacheStats().hits);
+}
+
+TEST(Database, queryCacheLargeResult) {
+  sqlitepp::Database database(":memory:");
+  database.execute("CREATE TABLE cached (id INTEGER, value TEXT);");
+  database.execute("WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL "
+                   "SELECT i + 1 FROM n WHERE i < 100) "
+                   "INSERT INTO cached SELECT i, printf('%.100c', 'x') "
+                   "FROM n;");
+  database.enableQueryCache(4096);
+
+  // the result does not fit into the cache, so it is streamed after the
+  // rows that were fetched while trying to cache it
+  std::shared_ptr<sqlitepp::Statement> select = database.prepare(
+      "SELECT id, value FROM cached ORDER BY id;");
+  sqlitepp::ResultSet resultSet = select->execute();
+  int rows = 0;
+  while (resultSet.canRead()) {
+    rows++;
+    EXPECT_EQ(rows, resultSet.readInt(0));
+    EXPECT_EQ(std::string(100, 'x'), resultSet.readString(1));
+    resultSet.next();
+  }
+  EXPECT_EQ(100, rows);
+  EXPECT_EQ(0u, database.queryCacheStats().entries);
+
+  // small results are still cached
+  std::shared_ptr<sqlitepp::Statement> count = database.prepare(
+      "SELECT COUNT(*) FROM cached;");
+  EXPECT_EQ(100, count->execute().readInt(0));
+  EXPECT_EQ(1u, database.queryCacheStats().entries);
+}
+
+TEST(Database, queryCacheSavepoint) {
+  sqlitepp::Database database(":memory:");
+  database.execute("CREATE TABLE cached (id, value);");
+  database.execute("INSERT INTO cached VALUES (1, 'a');");
+  database.enableQueryCache(1024 * 1024);
+
+  std::shared_ptr<sqlitepp::Statement> select = database.prepare(
+      "SELECT value FROM cached WHERE id = 1;");
+  database.execute("SAVEPOINT s;");
+  database.execute("UPDATE cached SET value = 'b' WHERE id = 1;");
+  EXPECT_EQ("b", select->execute().readString(0));
+  EXPECT_EQ(1u, database.queryCacheStats().entries);
+  database.execute("ROLLBACK TO s;");
+  database.execute("RELEASE s;");
+  select->reset();
+  EXPECT_EQ("a", select->execute().readString(0));
+}
+
+TEST(Database, changeFeed) {
+  sqlitepp::Database database("/tmp/test_changes.db");
+  database.execute("DROP TABLE IF EXISTS changes;");
+  database.execute("CREATE TABLE changes (id INTEGER PRIMARY KEY, value);");
+  std::vector<sqlitepp::ChangeBatch> batches;
+  const int subscription = database.subscribeChanges(
+      [&batches](const sqlitepp::ChangeBatch& batch) {
+        batches.push_back(batch);
+      });
+  auto queue = std::make_shared<sqlitepp::ChangeQueue>(1);
+  database.subscribeChanges(queue);
+
+  database.execute("BEGIN;");
+  database.execute("INSERT INTO changes VALUES (1, 'one');");
+  database.execute("ROLLBACK;");
+  EXPECT_TRUE(batches.empty());
+
+  database.execute("BEGIN;");
+  database.execute("INSERT INTO changes VALUES (1, 'one');");
+  database.execute("INSERT INTO changes VALUES (2, 'two');");
+  EXPECT_THROW(database.execute("INSERT INTO changes VALUES (3, 'three'), "
+                                "(1, 'duplicate');"),
+               sqlitepp::DatabaseError);
+  database.execute("UPDATE changes SET value = 'uno' WHERE id = 1;");
+  EXPECT_TRUE(batches.empty());
+  database.execute("COMMIT;");
+  ASSERT_EQ(1u, batches.size());
+  ASSERT_EQ(3u, batches[0].size());
+  EXPECT_EQ(sqlitepp::ChangeOperation::kInsert, batches[0][0].operation);
+  EXPECT_EQ("changes", batches[0][0].table);
+  EXPECT_EQ(1, batches[0][0].rowId);
+  EXPECT_EQ(2, batches[0][1].rowId);
+  EXPECT_EQ(sqlitepp::ChangeOperation::kUpdate, batches[0][2].operation);
+
+  database.unsubscribeChanges(subscription);
+  database.execute("DELETE FROM changes WHERE id = 2;");
+  EXPECT_EQ(1u, batches.size());
+
+  std::shared_ptr<const sqlitepp::ChangeBatch> batch;
+  ASSERT_TRUE(queue->pop(&batch));
+  EXPECT_EQ(3u, batch->size());
+  EXPECT_FALSE(queue->pop(&batch));
+  EXPECT_EQ(1u, queue->droppedBatches());
+}
+
+TEST(Database, changeFeedPartialRollback) {
+  sqlitepp::Database database(":memory:");
+  database.execute("CREATE TABLE changes (id INTEGER PRIMARY KEY, "
+                   "value UNIQUE ON CONFLICT FAIL);");
+  std::vector<sqlitepp::ChangeBatch> batches;
+  database.subscribeChanges([&batches](const sqlitepp::ChangeBatch& batch) {
+    batches.push_back(batch);
+  });
+
+  // ON CONFLICT FAIL keeps the rows inserted before the conflict
+  database.execute("BEGIN;");
+  EXPECT_THROW(database.execute("INSERT INTO changes VALUES (1, 'a'), "
+                                "(2, 'a');"),
+               sqlitepp::DatabaseError);
+  database.execute("COMMIT;");
+  ASSERT_EQ(1u, batches.size());
+  ASSERT_EQ(1u, batches[0].size());
+  EXPECT_EQ(1, batches[0][0].rowId);
+
+  // changes undone by ROLLBACK TO are not reported
+  database.execute("BEGIN;");
+  database.execute("INSERT INTO changes VALUES (3, 'c');");
+  database.execute("SAVEPOINT outer;");
+  database.execute("INSERT INTO changes VALUES (4, 'd');");
+  database.execute("SAVEPOINT inner;");
+  database.execute("INSERT INTO changes VALUES (5, 'e');");
+  database.execute("ROLLBACK TO outer;");
+  database.execute("INSERT INTO changes VALUES (6, 'f');");
+  database.execute("RELEASE outer;");
+  database.execute("COMMIT;");
+  ASSERT_EQ(2u, batches.size());
+  ASSERT_EQ(2u, batches[1].size());
+  EXPECT_EQ(3, batches[1][0].rowId);
+  EXPECT_EQ(6, batches[1][1].rowId);
+
+  // a PRAGMA with an argument is not a savepoint operation
+  database.execute("BEGIN;");
+  database.execute("SAVEPOINT sp;");
+  database.execute("INSERT INTO changes VALUES (8, 'h');");
+  database.prepare("PRAGMA table_info(sp);")->execute();
+  database.execute("ROLLBACK TO sp;");
+  database.execute("COMMIT;");
+  EXPECT_EQ(2u, batches.size());
+
+  // releasing the outermost savepoint commits the transaction
+  database.execute("SAVEPOINT s;");
+  database.execute("INSERT INTO changes VALUES (7, 'g');");
+  database.execute("RELEASE s;");
+  ASSERT_EQ(3u, batches.size());
+  ASSERT_EQ(1u, batches[2].size());
+  EXPECT_EQ(7, batches[2][0].rowId);
+}
+
+TEST(Database, closeBusy) {
+  sqlitepp::Database database(":memory:");
+  database.execute("CREATE TABLE changes (id INTEGER PRIMARY KEY, value);");
+  database.enableQueryCache(1024 * 1024);
+  std::vector<sqlitepp::ChangeBatch> batches;
+  database.subscribeChanges([&batches](const sqlitepp::ChangeBatch& batch) {
+    batches.push_back(batch);
+  });
+  std::shared_ptr<sqlitepp::Statement> select = database.prepare(
+      "SELECT COUNT(*) FROM changes;");
+  EXPECT_EQ(0, select->execute().readInt(0));
+
+  // a failed close keeps the cache and the subscriptions
+  EXPECT_THROW(database.close(), sqlitepp::DatabaseError);
+  EXPECT_TRUE(database.isOpen());
+  database.execute("INSERT INTO changes VALUES (1, 'one');");
+  EXPECT_EQ(1u, batches.size());
+  select->reset();
+  EXPECT_EQ(1, select->execute().readInt(0));
+  select->reset();
+  EXPECT_EQ(1, select->execute().readInt(0));
+  EXPECT_EQ(1u, database.queryCacheStats().hits);
+
+  select->close();
+  database.close();
+  EXPECT_FALSE(database.isOpen());
+}
+
+TEST(CheckpointManager, checkpoint) {
+  sqlitepp::Database database("/tmp/test_wal.db");
+  database.execute("PRAGMA journal_mode=WAL;");
+  database.execute("DROP TABLE IF EXISTS wal;");
+  database.execute("CREATE TABLE wal (id, value);");
+  sqlitepp::CheckpointManager manager("/tmp/test_wal.db", 10,
+                                      std::chrono::milliseconds(50));
+  manager.attach(&database);
+  EXPECT_EQ(0, database.prepare("PRAGMA wal_autocheckpoint;")->execute()
+      .readInt(0));
+
+  std::shared_ptr<sqlitepp::Statement> insert = database.prepare(
+      "INSERT INTO wal (id, value) VALUES (?, ?);");
+  for (int i = 0; i < 100; i++) {
+    insert->bind(1, i);
+    insert->bind(2, std::string(1000, 'x'));
+    insert->execute();
+    insert->reset();
+  }
+
+  sqlitepp::CheckpointStats stats = manager.stats();
+  for (int i = 0; i < 100 && stats.truncateCheckpoints == 0; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    stats = manager.stats();
+  }
+  EXPECT_LT(0u, stats.passiveCheckpoints + stats.busyCheckpoints);
+  EXPECT_EQ(1u, stats.truncateCheckpoints);
+  EXPECT_EQ(0u, stats.failedCheckpoints);
+  EXPECT_LE(stats.lastDuration, stats.maxDuration);
+
+  // stopping the manager restores the automatic checkpoints of the
+  // connections that are still open
+  sqlitepp::Database closed("/tmp/test_wal.db");
+  manager.attach(&closed);
+  closed.close();
+  manager.stop();
+  EXPECT_EQ(1000, database.prepare("PRAGMA wal_autocheckpoint;")->execute()
+      .readInt(0));
+  EXPECT_THROW(manager.attach(&database), std::logic_error);
+}
+
+TEST(Statement, deadline) {
+  sqlitepp::Database database(":memory:");
+  std::shared_ptr<sqlitepp::Statement> statement = database.prepare(
+      "WITH RECURSIVE counter(i) AS (SELECT 1 UNION ALL "
+      "SELECT i + 1 FROM counter) SELECT max(i) FROM counter;");
+  const auto start = std::chrono::steady_clock::now();
+  EXPECT_THROW(statement->execute(start + std::chrono::milliseconds(50)),
+               sqlitepp::TimeoutError);
+  EXPECT_GT(std::chrono::seconds(5),
+            std::chrono::steady_clock::now() - start);
+
+  statement = database.prepare("SELECT 1;");
+  sqlitepp::ResultSet resultSet = statement->execute(
+      std::chrono::steady_clock::now() + std::chrono::seconds(10));
+  EXPECT_EQ(1, resultSet.readInt(0));
+}
+
+TEST(Statement, cancel) {
+  sqlitepp::Database database(":memory:");
+  std::shared_ptr<sqlitepp::Statement> statement = database.prepare(
+      "WITH RECURSIVE counter(i) AS (SELECT 1 UNION ALL "
+      "SELECT i + 1 FROM counter) SELECT max(i) FROM counter;");
+  sqlitepp::CancellationToken token;
+  std::thread canceller([token]() mutable {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    token.cancel();
+  });
+  EXPECT_THROW(statement->execute(token), sqlitepp::CancelledError);
+  canceller.join();
+  EXPECT_TRUE(token.isCancelled());
+
+  statement->reset();
+  EXPECT_THROW(statement->execute(token), sqlitepp::CancelledError);
+}
+
+TEST(Database, explain) {
+  sqlitepp::Database database(":memory:");
+  database.execute("CREATE TABLE plan (id INTEGER PRIMARY KEY, a, b);");
+  database.execute("CREATE INDEX plan_a ON plan (a);");
+
+  sqlitepp::QueryPlan plan = database.explain(
+      "SELECT * FROM plan WHERE a = ?;");
+  ASSERT_EQ(1u, plan.nodes.size());
+  EXPECT_EQ(sqlitepp::PlanOperation::kSearch, plan.nodes[0].operation);
+  EXPECT_EQ("plan", plan.nodes[0].table);
+  EXPECT_EQ("plan_a", plan.nodes[0].index);
+  EXPECT_TRUE(plan.fullScans().empty());
+
+  plan = database.explain("SELECT DISTINCT b FROM plan WHERE b > 1;");
+  ASSERT_EQ(1u, plan.fullScans().size());
+  EXPECT_EQ("plan", plan.fullScans()[0]);
+  EXPECT_TRUE(plan.usesTempBTree());
+
+  plan = database.explain("SELECT * FROM plan WHERE id = 1;");
+  EXPECT_TRUE(plan.nodes[0].primaryKey);
+  EXPECT_FALSE(plan.nodes[0].isFullScan());
+
+  plan = database.explain("SELECT * FROM (SELECT b FROM plan GROUP BY b);");
+  EXPECT_EQ(1u, plan.fullScans().size());
+  EXPECT_NE(std::string::npos, plan.toString().find("  SCAN plan"));
+}
+
+TEST(Database, planCheck) {
+  sqlitepp::Database database(":memory:");
+  database.execute("CREATE TABLE small (a, b);");
+  database.execute("CREATE TABLE large (a, b);");
+  database.execute("WITH RECURSIVE counter(i) AS (SELECT 1 UNION ALL "
+                   "SELECT i + 1 FROM counter WHERE i < 100) "
+                   "INSERT INTO large SELECT i, i FROM counter;");
+
+  database.setPlanCheck(sqlitepp::PlanCheckAction::kFlag, 50);
+  EXPECT_TRUE(database.prepare("SELECT * FROM small WHERE b = 1;")
+      ->planWarnings().empty());
+  std::shared_ptr<sqlitepp::Statement> statement = database.prepare(
+      "SELECT * FROM large WHERE b = 1;");
+  ASSERT_EQ(1u, statement->planWarnings().size());
+  EXPECT_EQ("large", statement->planWarnings()[0]);
+
+  database.setPlanCheck(sqlitepp::PlanCheckAction::kReject, 50);
+  EXPECT_THROW(database.prepare("SELECT * FROM large WHERE b = 1;"),
+               sqlitepp::QueryPlanError);
+  // aliases are mapped to their tables, CTEs are not considered
+  EXPECT_NO_THROW(database.prepare("SELECT * FROM small AS s WHERE b = 1;"));
+  EXPECT_NO_THROW(database.prepare(
+      "WITH c AS MATERIALIZED (SELECT * FROM small) "
+      "SELECT * FROM c WHERE b = 1;"));
+  try {
+    database.prepare("SELECT * FROM small s JOIN \"large\" l "
+                     "ON s.a = l.a WHERE l.b = 1;");
+    ADD_FAILURE() << "Expected a QueryPlanError";
+  } catch (const sqlitepp::QueryPlanError& e) {
+    ASSERT_EQ(1u, e.tables().size());
+    EXPECT_EQ("large", e.tables()[0]);
+  }
+  database.execute("CREATE INDEX large_b ON large (b);");
+  EXPECT_NO_THROW(database.prepare("SELECT * FROM large WHERE b = 1;"));
+  database.setPlanCheck(sqlitepp::PlanCheckAction::kIgnore);
+}
+
+TEST(PrefetchCursor, iterate) {
+  sqlitepp::Database database(":memory:");
+  database.execute("CREATE TABLE prefetch (id, value);");
+  database.execute("WITH RECURSIVE counter(i) AS (SELECT 1 UNION ALL "
+                   "SELECT i + 1 FROM counter WHERE i < 1000) "
+                   "INSERT INTO prefetch SELECT i, 'row ' || i FROM counter;");
+  std::shared_ptr<sqlitepp::Statement> statement = database.prepare(
+      "SELECT id, value, id * 0.5 FROM prefetch ORDER BY id;");
+  {
+    sqlitepp::PrefetchCursor cursor(statement, 4);
+    int expected = 1;
+    for (const sqlitepp::Row& row : cursor) {
+      ASSERT_EQ(3, row.columnCount());
+      EXPECT_EQ(expected, row.readInt(0));
+      EXPECT_EQ("row " + std::to_string(expected), row.readString(1));
+      EXPECT_DOUBLE_EQ(expected * 0.5, row.readDouble(2));
+      expected++;
+    }
+    EXPECT_EQ(1001, expected);
+  }
+
+  // stop reading early
+  statement->reset();
+  {
+    sqlitepp::PrefetchCursor cursor(statement, 4);
+    sqlitepp::PrefetchCursor::iterator iterator = cursor.begin();
+    ASSERT_TRUE(iterator != cursor.end());
+    EXPECT_EQ(1, iterator->readInt(0));
+  }
+
+  statement = database.prepare(
+      "SELECT CASE WHEN id = 500 THEN abs(-9223372036854775807 - 1) "
+      "ELSE id END FROM prefetch;");
+  sqlitepp::PrefetchCursor cursor(statement, 4);
+  int rows = 0;
+  EXPECT_THROW({
+    for (const sqlitepp::Row& row : cursor) {
+      rows++;
+      EXPECT_EQ(rows, row.readInt(0));
+    }
+  }, sqlitepp::DatabaseError);
+  EXPECT_EQ(499, rows);
+}
+
+TEST(ShardedDatabase, routeAndMerge) {
+  sqlitepp::ShardedDatabase database({"/tmp/test_shard0.db",
+      "/tmp/test_shard1.db", "/tmp/test_shard2.db"});
+  EXPECT_EQ(3u, database.shardCount());
+  database.execute("DROP TABLE IF EXISTS sharded;");
+  database.execute("CREATE TABLE sharded (id, value);");
+
+  std::shared_ptr<sqlitepp::ShardedStatement> insert = database.prepare(
+      "INSERT INTO sharded (id, value) VALUES (:id, :value);");
+  database.begin();
+  for (int id = 0; id < 30; id++) {
+    insert->bind(":id", id);
+    insert->bind(":value", "value " + std::to_string(id));
+    insert->execute(static_cast<sqlite3_int64>(id));
+    insert->reset();
+  }
+  database.commit();
+
+  std::vector<int> counts(3, 0);
+  for (int id = 0; id < 30; id++) {
+    counts[database.shardFor(static_cast<sqlite3_int64>(id))]++;
+  }
+  for (std::size_t i = 0; i < 3; i++) {
+    sqlitepp::ResultSet count = database.shard(i).prepare(
+        "SELECT count(*) FROM sharded;")->execute();
+    EXPECT_EQ(counts[i], count.readInt(0));
+  }
+
+  std::shared_ptr<sqlitepp::ShardedStatement> select = database.prepare(
+      "SELECT id, value FROM sharded WHERE id >= ? ORDER BY id;");
+  select->bind(1, 10);
+  sqlitepp::ShardedResultSet resultSet = select->executeMerged(0);
+  for (int id = 10; id < 30; id++) {
+    ASSERT_TRUE(resultSet.canRead());
+    EXPECT_EQ(id, resultSet.readInt(0));
+    EXPECT_EQ("value " + std::to_string(id), resultSet.readString(1));
+    EXPECT_EQ(database.shardFor(static_cast<sqlite3_int64>(id)),
+              resultSet.currentShard());
+    resultSet.next();
+  }
+  EXPECT_FALSE(resultSet.canRead());
+
+  database.begin();
+  database.execute("DELETE FROM sharded;");
+  database.rollback();
+  select->reset();
+  select->bind(1, 0);
+  sqlitepp::ShardedResultSet all = select->executeAll();
+  int rows = 0;
+  while (all.canRead()) {
+    rows++;
+    all.next();
+  }
+  EXPECT_EQ(30, rows);
+  EXPECT_THROW(select->bind(2, 0), std::out_of_range);
+
+  // if a shard cannot begin, the shards before it are rolled back
+  select->close();
+  database.shard(1).execute("BEGIN;");
+  EXPECT_THROW(database.begin(), sqlitepp::DatabaseError);
+  database.shard(0).execute("BEGIN;");
+  database.shard(0).execute("ROLLBACK;");
+  database.shard(1).execute("ROLLBACK;");
+}
+
+TEST(Database, openImmutable) {
+  const std::string file = "/tmp/test immutable#1.db";
+  std::remove(file.c_str());
+  sqlitepp::Database writer(file);
+  writer.execute("CREATE TABLE immutable (id INTEGER, value TEXT);");
+  writer.execute("INSERT INTO immutable VALUES (1, 'one'), (2, 'two');");
+  writer.close();
+
+  sqlitepp::Database first;
+  first.openImmutable(file);
+  sqlitepp::Database second;
+  second.openImmutable(file, 1024 * 1024);
+  EXPECT_LT(0, first.prepare("PRAGMA mmap_size;")->execute().readInt(0));
+  EXPECT_EQ(1024 * 1024,
+            second.prepare("PRAGMA mmap_size;")->execute().readInt(0));
+
+  first.enableQueryCache(1024 * 1024);
+  std::shared_ptr<sqlitepp::Statement> statement = first.prepare(
+      "SELECT value FROM immutable WHERE id = 2;");
+  EXPECT_EQ("two", statement->execute().readString(0));
+  statement->reset();
+  EXPECT_EQ("two", statement->execute().readString(0));
+  EXPECT_EQ(1u, first.queryCacheStats().hits);
+  EXPECT_EQ(2, second.prepare("SELECT count(*) FROM immutable;")
+                   ->execute().readInt(0));
+
+  EXPECT_THROW(first.execute("DELETE FROM immutable;"),
+               sqlitepp::DatabaseError);
+  EXPECT_THROW(first.openImmutable(file), std::logic_error);
+  statement->close();
+  first.close();
+  second.close();
+
+  sqlitepp::Database missing;
+  EXPECT_THROW(missing.openImmutable("/tmp/test_missing.db"),
+               sqlitepp::DatabaseError);
+  EXPECT_FALSE(missing.isOpen());
+  std::remove(file.c_str());
+}
+
 TEST(Database, cleanup) {
   sqlitepp::Database database("/tmp/test.db");
   database.execute("DROP TABLE test;");